@@ -1,10 +1,15 @@
 #include "graphics.h"
 #include "threads.h"
+#include "simd.h"
+#include <algorithm>
+#include <array>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <memory>
+#include <utility>
 #include <vector>
 #include <mutex>
 
@@ -134,6 +139,86 @@ std::string Vec3::toString() {
 
 
 
+//-----------------------------------------------------------------------------------
+// IMPLEMENTATION OF "Mat4"
+
+// CONSTRUCTORS
+Mat4::Mat4() {
+    for (int row = 0; row < 4; row++) {
+        for (int column = 0; column < 4; column++) {
+            m[row][column] = row == column ? 1 : 0;
+        }
+    }
+}
+
+// OPERATIONS
+Mat4 Mat4::operator*(const Mat4& other) const {
+    Mat4 result;
+    for (int row = 0; row < 4; row++) {
+        for (int column = 0; column < 4; column++) {
+            result.m[row][column] = m[row][0] * other.m[0][column] + m[row][1] * other.m[1][column] + m[row][2] * other.m[2][column] + m[row][3] * other.m[3][column];
+        }
+    }
+    return result;
+}
+Vec3 Mat4::transformPoint(const Vec3& vec) const {
+    return Vec3(
+        m[0][0] * vec.x + m[0][1] * vec.y + m[0][2] * vec.z + m[0][3],
+        m[1][0] * vec.x + m[1][1] * vec.y + m[1][2] * vec.z + m[1][3],
+        m[2][0] * vec.x + m[2][1] * vec.y + m[2][2] * vec.z + m[2][3]
+        );
+}
+void Mat4::transform(float x, float y, float z, float w, float* out) const {
+    for (int row = 0; row < 4; row++) {
+        out[row] = m[row][0] * x + m[row][1] * y + m[row][2] * z + m[row][3] * w;
+    }
+}
+void Mat4::transformPoints(int count, const float* x, const float* y, const float* z, float* outX, float* outY, float* outZ, float* outW) const {
+    float* out[4] = {outX, outY, outZ, outW};
+    int rows = outW == nullptr ? 3 : 4;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        simd::Float4 vx = simd::load(x + i);
+        simd::Float4 vy = simd::load(y + i);
+        simd::Float4 vz = simd::load(z + i);
+        for (int row = 0; row < rows; row++) {
+            simd::Float4 result = simd::set1(m[row][0]) * vx + simd::set1(m[row][1]) * vy + simd::set1(m[row][2]) * vz + simd::set1(m[row][3]);
+            simd::store(out[row] + i, result);
+        }
+    }
+    for (; i < count; i++) {
+        for (int row = 0; row < rows; row++) {
+            out[row][i] = m[row][0] * x[i] + m[row][1] * y[i] + m[row][2] * z[i] + m[row][3];
+        }
+    }
+}
+
+// BUILDING MATRICES
+Mat4 Mat4::translation(const Vec3& vec) {
+    Mat4 result;
+    result.m[0][3] = vec.x;
+    result.m[1][3] = vec.y;
+    result.m[2][3] = vec.z;
+    return result;
+}
+Mat4 Mat4::rotationZKnownTrig(float sinthetaZ, float costhetaZ) {
+    Mat4 result;
+    result.m[0][0] = costhetaZ;
+    result.m[0][1] = -sinthetaZ;
+    result.m[1][0] = sinthetaZ;
+    result.m[1][1] = costhetaZ;
+    return result;
+}
+Mat4 Mat4::rotationYKnownTrig(float sinthetaY, float costhetaY) {
+    Mat4 result;
+    result.m[0][0] = costhetaY;
+    result.m[0][2] = -sinthetaY;
+    result.m[2][0] = sinthetaY;
+    result.m[2][2] = costhetaY;
+    return result;
+}
+
+
 //-----------------------------------------------------------------------------------
 // IMPLEMENTATION OF "Point"
 
@@ -148,9 +233,7 @@ Point::Point() {}
 
 // METHODS
 void Point::calculateCameraPos(const Camera &cam) {
-    cameraPos = absolutePos - cam.pos;
-    // cameraPos.rotate(-cam.thetaZ, -cam.thetaY);
-    cameraPos.rotateKnownTrig(-cam.sinthetaZ, cam.costhetaZ, -cam.sinthetaY, cam.costhetaY);
+    cameraPos = cam.view.transformPoint(absolutePos);
     distToCamera = cameraPos.mag();
 }
 void Point::calculateProjectedPos() {
@@ -227,216 +310,422 @@ void Line::draw(const Camera& cam, Window& window) {
 // IMPLEMENTATION OF "Triangle"
 
 // CONSTRUCTOR
-// NOTE: When points are given in clockwise order, the normal vector points towards the camera
 std::vector<Triangle> Triangle::triangles; // defining the static variable, TODO: check if this is right
-Triangle::Triangle(Vec3 p1, Vec3 p2, Vec3 p3, int r, int g, int b) : p1(p1), p2(p2), p3(p3), r(r), g(g), b(b) {
-    this->absoluteNormal = (p3 - p1).cross(p2 - p1);
-    this->absoluteNormal.normalize();
-}
-Triangle::Triangle(Point p1, Point p2, Point p3) {
-    this->p1 = p1;
-    this->p2 = p2;
-    this->p3 = p3;
-    this->absoluteNormal = (p3.absolutePos - p1.absolutePos).cross(p2.absolutePos - p1.absolutePos);
-    absoluteNormal.normalize();
-    this->r = std::rand() % 256;
-    this->g = std::rand() % 256;
-    this->b = std::rand() % 256;
-}
-Triangle::Triangle(Vec3 p1, Vec3 p2, Vec3 p3) : p1(p1), p2(p2), p3(p3) {
-    absoluteNormal = (p3 - p1).cross(p2 - p1);
-    absoluteNormal.normalize();
-    this->r = std::rand() % 256;
-    this->g = std::rand() % 256;
-    this->b = std::rand() % 256;
-}
+Triangle::Triangle(int v1, int v2, int v3, Vec3 absoluteNormal, int r, int g, int b) : v1(v1), v2(v2), v3(v3), absoluteNormal(absoluteNormal), r(r), g(g), b(b) {}
 Triangle::Triangle() {}
 
 // METHODS
-void Triangle::draw(Camera& cam, Window& window, const Object3D& object) {
+void Triangle::draw(Camera& cam, Window& window, const Object3D& object) const {
+    // the corners were already transformed to camera space by Object3D::transformVertices
+    const Point& p1 = object.vertices[v1];
+    const Point& p2 = object.vertices[v2];
+    const Point& p3 = object.vertices[v3];
     Vec3 toCam = cam.pos - p1.absolutePos;
     if (absoluteNormal.dot(toCam) < 0) {
         return;
     }
-    p1.calculateCameraPos(cam);
-    p2.calculateCameraPos(cam);
-    p3.calculateCameraPos(cam);
 
-    cameraNormal = (p2.cameraPos - p1.cameraPos).cross(p3.cameraPos - p1.cameraPos);
+    Vec3 cameraNormal = (p2.cameraPos - p1.cameraPos).cross(p3.cameraPos - p1.cameraPos);
     cameraNormal.normalize();
 
-    p1.calculateProjectedPos();
-    p2.calculateProjectedPos();
-    p3.calculateProjectedPos();
-
-    std::array<Point*, 3> front;
-    int frontSize = 0;
-    std::array<Point*, 3> behind;
-    int behindSize = 0;
+    // nothing to clip, the cached screen positions of the vertices can be used as they are
+    if (p1.cameraPos.x >= Camera::NEAR_PLANE && p2.cameraPos.x >= Camera::NEAR_PLANE && p3.cameraPos.x >= Camera::NEAR_PLANE) {
+        window.drawTriangle(p1, p2, p3, cameraNormal, *this, object, cam);
+        return;
+    }
 
-    if (p1.projectedPos.z > 0) {
-        front[frontSize] = &p1;
-        ++frontSize;
-    } else {
-        behind[behindSize] = &p1;
-        ++behindSize;
+    // clip against the near plane, the result is drawn as a triangle fan
+    std::array<Point, 4> clipped;
+    int clippedSize = clipToNearPlane(p1, p2, p3, clipped);
+    for (int i = 0; i < clippedSize; i++) {
+        clipped[i].calculateProjectedPos();
+        clipped[i].calculateScreenPos(cam, window);
+    }
+    for (int i = 1; i + 1 < clippedSize; i++) {
+        window.drawTriangle(clipped[0], clipped[i], clipped[i + 1], cameraNormal, *this, object, cam);
+    }
+}
+int Triangle::clipToNearPlane(const Point& p1, const Point& p2, const Point& p3, std::array<Point, 4>& clipped) {
+    // Sutherland-Hodgman against the plane cameraPos.x = Camera::NEAR_PLANE, needs cameraPos to be calculated.
+    // Clipping a triangle against one plane gives at most 4 corners
+    const Point* corners[3] = {&p1, &p2, &p3};
+    int size = 0;
+    for (int i = 0; i < 3; i++) {
+        const Point& current = *corners[i];
+        const Point& next = *corners[(i + 1) % 3];
+        bool currentInside = current.cameraPos.x >= Camera::NEAR_PLANE;
+        bool nextInside = next.cameraPos.x >= Camera::NEAR_PLANE;
+        if (currentInside) {
+            clipped[size] = current;
+            size++;
+        }
+        if (currentInside != nextInside) {
+            // always from the inside corner, so the triangle on the other side of the edge gets the very same point
+            const Point& inside = currentInside ? current : next;
+            const Point& outside = currentInside ? next : current;
+            float t = (Camera::NEAR_PLANE - inside.cameraPos.x) / (outside.cameraPos.x - inside.cameraPos.x);
+            Point& intersection = clipped[size];
+            intersection.absolutePos = inside.absolutePos + t * (outside.absolutePos - inside.absolutePos);
+            intersection.cameraPos = inside.cameraPos + t * (outside.cameraPos - inside.cameraPos);
+            intersection.cameraPos.x = Camera::NEAR_PLANE;
+            size++;
+        }
     }
-    if (p2.projectedPos.z > 0) {
-        front[frontSize] = &p2;
-        ++frontSize;
-    } else {
-        behind[behindSize] = &p2;
-        ++behindSize;
+    return size;
+}
+void Triangle::shadePixel(Camera &cam, Window &window, const Triangle &triangle, int x, int y, float inverseDepth, const std::vector<int>& lightIndices) {
+    // normalized screen position of the pixel center, with the inverse depth as z it maps straight back to world space
+    float ndcX = 1 - (2 * x + 1) * window.widthInv;
+    float ndcY = 1 - (2 * y + 1) * window.heightInv;
+    float world[4];
+    cam.inverseViewProjection.transform(ndcX, ndcY, inverseDepth, 1, world);
+    Vec3 vec(world[0], world[1], world[2]);
+    vec *= 1 / world[3];
+
+    // a light only adds anything, including the darkening of faces turned away from it, where it reaches.
+    // Window::cullLights() relies on that to leave lights out of tiles they don't reach
+    float multiplier = 0.2;
+    for (int lightIndex : lightIndices) {
+        Light& light = Light::lights[lightIndex];
+        if (!light.mayLight(&vec, 1)) {
+            continue;
+        }
+        Vec3 vecToLight = light.cam.pos - vec;
+        float vecToLightMagInv = 1.0 / vecToLight.mag();
+        vecToLight *= vecToLightMagInv;
+        float angleLighting = vecToLight.dot(triangle.absoluteNormal);
+        if (angleLighting > 0) {
+            multiplier += 0.8 * light.amountLit(vec, triangle.absoluteNormal, vecToLightMagInv) * angleLighting;
+        } else {
+            multiplier += 0.05 * angleLighting;
+        }
     }
-    if (p3.projectedPos.z > 0) {
-        front[frontSize] = &p3;
-        ++frontSize;
-    } else {
-        behind[behindSize] = &p3;
-        ++behindSize;
+    utils::clampToRange(multiplier, 0, 1);
+    window.pixelArray.setPixel(x, y, multiplier * triangle.r, multiplier * triangle.g, multiplier * triangle.b);
+}
+
+
+//-----------------------------------------------------------------------------------
+// IMPLEMENTATION OF "BVH"
+
+static float axisOf(const Vec3& vec, int axis) {
+    return axis == 0 ? vec.x : axis == 1 ? vec.y : vec.z;
+}
+static void growBounds(Vec3& boundsMin, Vec3& boundsMax, const Vec3& otherMin, const Vec3& otherMax) {
+    boundsMin.x = std::min(boundsMin.x, otherMin.x);
+    boundsMin.y = std::min(boundsMin.y, otherMin.y);
+    boundsMin.z = std::min(boundsMin.z, otherMin.z);
+    boundsMax.x = std::max(boundsMax.x, otherMax.x);
+    boundsMax.y = std::max(boundsMax.y, otherMax.y);
+    boundsMax.z = std::max(boundsMax.z, otherMax.z);
+}
+static const Vec3 EMPTY_MIN(INFINITY, INFINITY, INFINITY);
+static const Vec3 EMPTY_MAX(-INFINITY, -INFINITY, -INFINITY);
+
+// CONSTRUCTOR
+BVH::BVH() {
+    builtItems = 0;
+}
+
+// METHODS
+void BVH::build() {
+    int numItems = itemMin.size();
+    indices.resize(numItems);
+    for (int i = 0; i < numItems; i++) {
+        indices[i] = i;
+    }
+    builtItems = numItems;
+    nodes.clear();
+    if (numItems == 0) {
+        return;
     }
 
-    if (frontSize == 0) {
+    // a binary tree with at least one item per leaf never has more nodes than this,
+    // so tasks can take nodes from it without it ever being reallocated
+    nodes.resize(2 * numItems - 1);
+    std::atomic<int> nodesUsed(1);
+    threads::TaskGroup tasks;
+    buildNode(0, 0, numItems, 1, nodesUsed, tasks);
+    tasks.wait();
+    nodes.resize(nodesUsed);
+}
+void BVH::buildNode(int nodeIndex, int first, int count, int depth, std::atomic<int>& nodesUsed, threads::TaskGroup& tasks) {
+    Node& node = nodes[nodeIndex];
+    node.boundsMin = EMPTY_MIN;
+    node.boundsMax = EMPTY_MAX;
+    Vec3 centerMin = EMPTY_MIN;
+    Vec3 centerMax = EMPTY_MAX;
+    for (int i = first; i < first + count; i++) {
+        int item = indices[i];
+        growBounds(node.boundsMin, node.boundsMax, itemMin[item], itemMax[item]);
+        Vec3 center = (itemMin[item] + itemMax[item]) * 0.5;
+        growBounds(centerMin, centerMax, center, center);
+    }
+    node.first = first;
+    node.count = count;
+    if (count <= MAX_LEAF_SIZE) {
         return;
-    } else if (frontSize == 1) {
-        behind[0]->projectedPos += 100 * (front[0]->projectedPos - behind[0]->projectedPos);
-        behind[0]->projectedPos.z = 1;
-        behind[1]->projectedPos += 100 * (front[0]->projectedPos - behind[1]->projectedPos);
-        behind[1]->projectedPos.z = 1;
-
-        front[0]->calculateScreenPos(cam, window);
-        behind[0]->calculateScreenPos(cam, window);
-        behind[1]->calculateScreenPos(cam, window);
-
-        window.drawTriangle(*this, object, cam);
-    } else if (frontSize == 2) {
-        front[0]->calculateScreenPos(cam, window);
-        front[1]->calculateScreenPos(cam, window);
-
-        Point behind2 = *behind[0];
-        behind[0]->projectedPos += 100 * (front[0]->projectedPos - behind[0]->projectedPos);
-        behind2.projectedPos += 100 * (front[1]->projectedPos - behind2.projectedPos);
-
-        behind[0]->calculateScreenPos(cam, window);
-        behind2.calculateScreenPos(cam, window);
-
-        // needed to preserve the 3 original cameraPos values to be used in plane-calculation for depth buffer
-        behind2.cameraPos = front[0]->cameraPos;
-
-        std::shared_ptr<Triangle> t = std::shared_ptr<Triangle>(new Triangle(*front[1], *behind[0], behind2));
-        t->absoluteNormal = absoluteNormal;
-        t->cameraNormal = cameraNormal;
-        t->r = r;
-        t->g = g;
-        t->b = b;
-
-        window.drawTriangle(*this, object, cam);
-        window.drawTriangle(t, object, cam);
-    } else {
-        front[0]->calculateScreenPos(cam, window);
-        front[1]->calculateScreenPos(cam, window);
-        front[2]->calculateScreenPos(cam, window);
-
-        window.drawTriangle(*this, object, cam);
-    }
-}
-void Triangle::drawVerticalScreenLine(Camera &cam, Window &window, const Triangle &triangle, const Object3D& object, int x, float y1, float y2, float d1) {
-    int bottom = round(y1);
-    int top = round(y2);
-    utils::sortAndClamp(bottom, top, window.height - 1);
-    float cameraY = cam.getCameraYFromPixelFast(x, window.widthInv);
-    float depth;
-    for (int y = bottom; y <= top; y++) {
-        // calculate depth
-        float cameraZ = cam.getCameraZFromPixelFast(y, window.heightInv);
-        float cameraX = 1;
-        float denom = triangle.cameraNormal.x * cameraX + triangle.cameraNormal.y * cameraY + triangle.cameraNormal.z * cameraZ;
-        float cameraVecLength = sqrt(cameraX * cameraX + cameraY * cameraY + cameraZ * cameraZ);
-        depth = (d1 / denom) * cameraVecLength;
-        depth = std::max(depth, 0.0f);
-
-        if (depth < window.zBuffer.getDepth(x, y)) {
-            window.zBuffer.setDepth(x, y, depth);
-
-            if (x == window.width * 0.5 && y == window.height * 0.5) {
-                cam.lookingAtTriangle = &triangle;
-                cam.lookingAtObject = &object;
+    }
+
+    // binned surface area heuristic: sort the item centers into buckets along every axis and take the
+    // split between buckets with the smallest sum of area times number of items over both sides
+    int bestAxis = -1;
+    int bestSplit = 0;
+    float bestCost = INFINITY;
+    // unlucky item distributions can make the heuristic peel off a few items at a time, past half of
+    // MAX_DEPTH the items are just halved, which is always shallow enough
+    bool halve = depth > MAX_DEPTH / 2;
+    for (int axis = 0; axis < 3 && !halve; axis++) {
+        float low = axisOf(centerMin, axis);
+        float high = axisOf(centerMax, axis);
+        if (!(high > low)) {
+            continue;
+        }
+        float scale = SAH_BUCKETS / (high - low);
+        int bucketCount[SAH_BUCKETS] = {};
+        Vec3 bucketMin[SAH_BUCKETS], bucketMax[SAH_BUCKETS];
+        std::fill(bucketMin, bucketMin + SAH_BUCKETS, EMPTY_MIN);
+        std::fill(bucketMax, bucketMax + SAH_BUCKETS, EMPTY_MAX);
+        for (int i = first; i < first + count; i++) {
+            int item = indices[i];
+            float center = 0.5f * (axisOf(itemMin[item], axis) + axisOf(itemMax[item], axis));
+            int bucket = std::min((int) ((center - low) * scale), SAH_BUCKETS - 1);
+            bucketCount[bucket]++;
+            growBounds(bucketMin[bucket], bucketMax[bucket], itemMin[item], itemMax[item]);
+        }
+
+        // cost of everything above each split, then sweep up from the bottom
+        float aboveCost[SAH_BUCKETS];
+        Vec3 sideMin = EMPTY_MIN, sideMax = EMPTY_MAX;
+        int sideCount = 0;
+        for (int split = SAH_BUCKETS - 1; split > 0; split--) {
+            growBounds(sideMin, sideMax, bucketMin[split], bucketMax[split]);
+            sideCount += bucketCount[split];
+            aboveCost[split] = sideCount == 0 ? 0 : sideCount * surfaceArea(sideMin, sideMax);
+        }
+        sideMin = EMPTY_MIN;
+        sideMax = EMPTY_MAX;
+        sideCount = 0;
+        for (int split = 1; split < SAH_BUCKETS; split++) {
+            growBounds(sideMin, sideMax, bucketMin[split - 1], bucketMax[split - 1]);
+            sideCount += bucketCount[split - 1];
+            if (sideCount == 0 || sideCount == count) {
+                continue;
             }
+            float cost = sideCount * surfaceArea(sideMin, sideMax) + aboveCost[split];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = split;
+            }
+        }
+    }
 
-            Vec3 vec(cameraX, cameraY, cameraZ);
-            vec /= cameraVecLength;
-            vec *= depth;
-            // vec.rotateY(cam.thetaY);
-            vec.rotateYKnownTrig(cam.sinthetaY, cam.costhetaY);
-            // vec.rotateZ(cam.thetaZ);
-            vec.rotateZKnownTrig(cam.sinthetaZ, cam.costhetaZ);
-            vec += cam.pos;
-
-            Vec3 vecToLight = Light::lights[0].cam.pos - vec;
-            float vecToLightMagInv = 1.0 / vecToLight.mag();
-            vecToLight *= vecToLightMagInv;
-            float shadowMapLightingAmount = Light::lights[0].amountLit(vec, vecToLightMagInv);
-            float angleLighting = vecToLight.dot(triangle.absoluteNormal);
-
-            float multiplier;
-            if (angleLighting > 0) {
-                multiplier = 0.2 + 0.8 * shadowMapLightingAmount * angleLighting;
-            } else {
-                multiplier = 0.2 + 0.05 * angleLighting;
+    int middle;
+    if (halve || bestAxis < 0) {
+        // along the longest axis, when every center is in the same place no plane separates anything anyway
+        Vec3 extent = centerMax - centerMin;
+        int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+        middle = first + count / 2;
+        std::nth_element(indices.begin() + first, indices.begin() + middle, indices.begin() + first + count, [this, axis](int a, int b) {
+            return axisOf(itemMin[a], axis) + axisOf(itemMax[a], axis) < axisOf(itemMin[b], axis) + axisOf(itemMax[b], axis);
+        });
+    } else {
+        float low = axisOf(centerMin, bestAxis);
+        float scale = SAH_BUCKETS / (axisOf(centerMax, bestAxis) - low);
+        int axis = bestAxis;
+        int split = bestSplit;
+        middle = std::partition(indices.begin() + first, indices.begin() + first + count, [this, axis, low, scale, split](int item) {
+            float center = 0.5f * (axisOf(itemMin[item], axis) + axisOf(itemMax[item], axis));
+            return std::min((int) ((center - low) * scale), SAH_BUCKETS - 1) < split;
+        }) - indices.begin();
+    }
+
+    int children = nodesUsed.fetch_add(2);
+    node.first = children;
+    node.count = INNER;
+    if (count > PARALLEL_BUILD_SIZE) {
+        tasks.addTask([this, children, first, middle, depth, &nodesUsed, &tasks] {
+            buildNode(children, first, middle - first, depth + 1, nodesUsed, tasks);
+        });
+    } else {
+        buildNode(children, first, middle - first, depth + 1, nodesUsed, tasks);
+    }
+    buildNode(children + 1, middle, first + count - middle, depth + 1, nodesUsed, tasks);
+}
+void BVH::refit() {
+    // children come after their parent, so going backwards every child is done before its parent
+    for (int i = (int) nodes.size() - 1; i >= 0; i--) {
+        Node& node = nodes[i];
+        node.boundsMin = EMPTY_MIN;
+        node.boundsMax = EMPTY_MAX;
+        if (node.count == INNER) {
+            growBounds(node.boundsMin, node.boundsMax, nodes[node.first].boundsMin, nodes[node.first].boundsMax);
+            growBounds(node.boundsMin, node.boundsMax, nodes[node.first + 1].boundsMin, nodes[node.first + 1].boundsMax);
+        } else {
+            for (int j = node.first; j < node.first + node.count; j++) {
+                growBounds(node.boundsMin, node.boundsMax, itemMin[indices[j]], itemMax[indices[j]]);
             }
-            window.pixelArray.setPixel(x, y, multiplier * triangle.r, multiplier * triangle.g, multiplier * triangle.b);
-        }
-    }
-}
-void Triangle::drawVerticalScreenLine(Camera& cam, Window& window, const std::shared_ptr<Triangle> triangle, const Object3D& object, int x, float y1, float y2, float d1) {
-    int bottom = round(y1);
-    int top = round(y2);
-    utils::sortAndClamp(bottom, top, window.height - 1);
-    float cameraY = cam.getCameraYFromPixelFast(x, window.widthInv);
-    float depth;
-    for (int y = bottom; y <= top; y++) {
-        // calculate depth
-        float cameraZ = cam.getCameraZFromPixelFast(y, window.heightInv);
-        float cameraX = 1;
-        float denom = triangle->cameraNormal.x * cameraX + triangle->cameraNormal.y * cameraY + triangle->cameraNormal.z * cameraZ;
-        float cameraVecLength = sqrt(cameraX * cameraX + cameraY * cameraY + cameraZ * cameraZ);
-        depth = (d1 / denom) * cameraVecLength;
-        depth = std::max(depth, 0.0f);
-
-        if (depth < window.zBuffer.getDepth(x, y)) {
-            window.zBuffer.setDepth(x, y, depth);
-
-            if (x == window.width * 0.5 && y == window.height * 0.5) {
-                cam.lookingAtTriangle = triangle.get();
-                cam.lookingAtObject = &object;
+        }
+    }
+}
+void BVH::insert(const Vec3& boundsMin, const Vec3& boundsMax) {
+    int item = itemMin.size();
+    itemMin.push_back(boundsMin);
+    itemMax.push_back(boundsMax);
+    // every insertion makes the tree a bit worse, start over once it has doubled
+    if (nodes.empty() || item >= 2 * builtItems) {
+        build();
+        return;
+    }
+
+    // walk down to the node whose box grows the least by taking the item
+    int nodeIndex = 0;
+    int depth = 1;
+    while (nodes[nodeIndex].count == INNER) {
+        int best = -1;
+        float bestGrowth = INFINITY;
+        for (int child = nodes[nodeIndex].first; child <= nodes[nodeIndex].first + 1; child++) {
+            Vec3 grownMin = nodes[child].boundsMin;
+            Vec3 grownMax = nodes[child].boundsMax;
+            growBounds(grownMin, grownMax, boundsMin, boundsMax);
+            float growth = surfaceArea(grownMin, grownMax) - surfaceArea(nodes[child].boundsMin, nodes[child].boundsMax);
+            if (growth < bestGrowth) {
+                bestGrowth = growth;
+                best = child;
             }
+        }
+        nodeIndex = best;
+        depth++;
+    }
+    if (depth >= MAX_DEPTH) {
+        build();
+        return;
+    }
 
-            Vec3 vec(cameraX, cameraY, cameraZ);
-            vec /= cameraVecLength;
-            vec *= depth;
-            // vec.rotateY(cam.thetaY);
-            vec.rotateYKnownTrig(cam.sinthetaY, cam.costhetaY);
-            // vec.rotateZ(cam.thetaZ);
-            vec.rotateZKnownTrig(cam.sinthetaZ, cam.costhetaZ);
-            vec += cam.pos;
-
-            Vec3 vecToLight = Light::lights[0].cam.pos - vec;
-            float vecToLightMagInv = 1.0 / vecToLight.mag();
-            vecToLight *= vecToLightMagInv;
-            float shadowMapLightingAmount = Light::lights[0].amountLit(vec, vecToLightMagInv);
-            float angleLighting = vecToLight.dot(triangle->absoluteNormal);
-
-            float multiplier;
-            if (angleLighting > 0) {
-                multiplier = 0.2 + 0.8 * shadowMapLightingAmount * angleLighting;
-            } else {
-                multiplier = 0.2 + 0.05 * angleLighting;
+    Node& leaf = nodes[nodeIndex];
+    if (leaf.count < MAX_LEAF_SIZE && leaf.first + leaf.count == (int) indices.size()) {
+        // the leaf owns the last entries, it can simply take one more
+        indices.push_back(item);
+        leaf.count++;
+    } else {
+        // the leaf turns into an inner node over itself and a new leaf holding the item
+        Node moved = leaf;
+        Node added;
+        added.first = indices.size();
+        added.count = 1;
+        indices.push_back(item);
+        leaf.first = nodes.size();
+        leaf.count = INNER;
+        nodes.push_back(moved);
+        nodes.push_back(added);
+    }
+    refit();
+}
+void BVH::remove(int item) {
+    // the entry is swapped to the end of its leaf, which then stops owning it
+    for (Node& node : nodes) {
+        if (node.count == INNER) {
+            continue;
+        }
+        int last = node.first + node.count - 1;
+        int position = std::find(indices.begin() + node.first, indices.begin() + last + 1, item) - indices.begin();
+        if (position <= last) {
+            std::swap(indices[position], indices[last]);
+            indices[last] = -1;
+            node.count--;
+            break;
+        }
+    }
+    for (int& index : indices) {
+        if (index > item) {
+            index--;
+        }
+    }
+    itemMin.erase(itemMin.begin() + item);
+    itemMax.erase(itemMax.begin() + item);
+    if (itemMin.empty()) {
+        nodes.clear();
+        indices.clear();
+        builtItems = 0;
+        return;
+    }
+    refit();
+}
+template <typename ItemFunc>
+void BVH::traverseRay(const Vec3& origin, const Vec3& direction, float& maxDistance, ItemFunc onItem) const {
+    if (nodes.empty()) {
+        return;
+    }
+    Vec3 inverseDirection(1 / direction.x, 1 / direction.y, 1 / direction.z);
+    // nodes still to visit and where the ray enters them, nearest last
+    int stack[MAX_DEPTH];
+    float stackDistance[MAX_DEPTH];
+    int stackSize = 0;
+    float rootDistance = rayBoxDistance(origin, inverseDirection, nodes[0].boundsMin, nodes[0].boundsMax);
+    // misses are INFINITY, which must not pass when there is no distance limit either
+    if (rootDistance < maxDistance) {
+        stack[0] = 0;
+        stackDistance[0] = rootDistance;
+        stackSize = 1;
+    }
+    while (stackSize > 0) {
+        stackSize--;
+        // something nearer may have been found since the node was pushed
+        if (stackDistance[stackSize] >= maxDistance) {
+            continue;
+        }
+        const Node& node = nodes[stack[stackSize]];
+        if (node.count != INNER) {
+            for (int i = node.first; i < node.first + node.count; i++) {
+                onItem(indices[i]);
             }
-            window.pixelArray.setPixel(x, y, multiplier * triangle->r, multiplier * triangle->g, multiplier * triangle->b);
+            continue;
+        }
+        int near = node.first;
+        int far = node.first + 1;
+        float nearDistance = rayBoxDistance(origin, inverseDirection, nodes[near].boundsMin, nodes[near].boundsMax);
+        float farDistance = rayBoxDistance(origin, inverseDirection, nodes[far].boundsMin, nodes[far].boundsMax);
+        if (farDistance < nearDistance) {
+            std::swap(near, far);
+            std::swap(nearDistance, farDistance);
+        }
+        // the nearer child is pushed last so it is visited first
+        if (farDistance < maxDistance) {
+            stack[stackSize] = far;
+            stackDistance[stackSize++] = farDistance;
+        }
+        if (nearDistance < maxDistance) {
+            stack[stackSize] = near;
+            stackDistance[stackSize++] = nearDistance;
         }
     }
 }
 
+// STATIC METHODS
+float BVH::surfaceArea(const Vec3& boundsMin, const Vec3& boundsMax) {
+    Vec3 size = boundsMax - boundsMin;
+    if (size.x < 0 || size.y < 0 || size.z < 0) {
+        return 0;
+    }
+    return 2 * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+float BVH::rayBoxDistance(const Vec3& origin, const Vec3& inverseDirection, const Vec3& boundsMin, const Vec3& boundsMax) {
+    // slab test, the boxes of emptied leaves would pass it
+    if (boundsMin.x > boundsMax.x) {
+        return INFINITY;
+    }
+    float x1 = (boundsMin.x - origin.x) * inverseDirection.x;
+    float x2 = (boundsMax.x - origin.x) * inverseDirection.x;
+    float y1 = (boundsMin.y - origin.y) * inverseDirection.y;
+    float y2 = (boundsMax.y - origin.y) * inverseDirection.y;
+    float z1 = (boundsMin.z - origin.z) * inverseDirection.z;
+    float z2 = (boundsMax.z - origin.z) * inverseDirection.z;
+    float enter = std::max({std::min(x1, x2), std::min(y1, y2), std::min(z1, z2), 0.0f});
+    float exit = std::min({std::max(x1, x2), std::max(y1, y2), std::max(z1, z2)});
+    return enter <= exit ? enter : INFINITY;
+}
+
 
 //-----------------------------------------------------------------------------------
 // IMPLEMENTATION OF "Object3D"
@@ -444,39 +733,210 @@ void Triangle::drawVerticalScreenLine(Camera& cam, Window& window, const std::sh
 // STATIC VARIABLE
 std::vector<Object3D> Object3D::objects;
 int Object3D::objectCounter = 0;
+BVH Object3D::sceneBVH;
 
 // CONSTRUCTORS
-Object3D::Object3D(std::vector<Triangle> triangles, bool isDeletable) {
+Object3D::Object3D(std::vector<Point> vertices, std::vector<Triangle> triangles, bool isDeletable) {
+    this->vertices = vertices;
     this->triangles = triangles;
     this->isDeletable = isDeletable;
     id = ++objectCounter;
+    updateBounds();
 }
-Object3D::Object3D(std::vector<Triangle> triangles) : Object3D(triangles, true) {}
-Object3D::Object3D() : Object3D(std::vector<Triangle>(), true) {}
+Object3D::Object3D(std::vector<Point> vertices, std::vector<Triangle> triangles) : Object3D(vertices, triangles, true) {}
+Object3D::Object3D() : Object3D(std::vector<Point>(), std::vector<Triangle>(), true) {}
 
 // METHODS
 bool Object3D::operator==(const Object3D& other) const {
     return this->id == other.id;
 }
-void Object3D::drawMultithreaded(Camera& cam, Window& window) {
-    for (Triangle& triangle : triangles) {
-        threads::threadPool.addTask([&triangle, &cam, &window, this] {
-            triangle.draw(cam, window, *this);
-        });
+int Object3D::addVertex(Vec3 pos) {
+    vertices.push_back(Point(pos));
+    return vertices.size() - 1;
+}
+void Object3D::addTriangle(int v1, int v2, int v3, int r, int g, int b) {
+    const Vec3& p1 = vertices[v1].absolutePos;
+    const Vec3& p2 = vertices[v2].absolutePos;
+    const Vec3& p3 = vertices[v3].absolutePos;
+    Vec3 absoluteNormal = (p3 - p1).cross(p2 - p1);
+    absoluteNormal.normalize();
+    triangles.push_back(Triangle(v1, v2, v3, absoluteNormal, r, g, b));
+}
+void Object3D::updateBounds() {
+    // NOTE: must be called again whenever vertices are added or moved
+    if (vertices.empty()) {
+        boundsMin = Vec3(0, 0, 0);
+        boundsMax = Vec3(0, 0, 0);
+        boundsCenter = Vec3(0, 0, 0);
+        boundsRadius = 0;
+        bvh = BVH();
+        return;
+    }
+    boundsMin = vertices[0].absolutePos;
+    boundsMax = vertices[0].absolutePos;
+    for (const Point& p : vertices) {
+        boundsMin.x = std::min(boundsMin.x, p.absolutePos.x);
+        boundsMin.y = std::min(boundsMin.y, p.absolutePos.y);
+        boundsMin.z = std::min(boundsMin.z, p.absolutePos.z);
+        boundsMax.x = std::max(boundsMax.x, p.absolutePos.x);
+        boundsMax.y = std::max(boundsMax.y, p.absolutePos.y);
+        boundsMax.z = std::max(boundsMax.z, p.absolutePos.z);
+    }
+    // tighter than half the diagonal of the box for round meshes
+    boundsCenter = 0.5 * (boundsMin + boundsMax);
+    float radiusSquared = 0;
+    for (const Point& p : vertices) {
+        Vec3 offset = p.absolutePos - boundsCenter;
+        radiusSquared = std::max(radiusSquared, offset.dot(offset));
+    }
+    boundsRadius = sqrt(radiusSquared);
+
+    bvh.itemMin.resize(triangles.size());
+    bvh.itemMax.resize(triangles.size());
+    for (size_t i = 0; i < triangles.size(); i++) {
+        const Vec3& p1 = vertices[triangles[i].v1].absolutePos;
+        const Vec3& p2 = vertices[triangles[i].v2].absolutePos;
+        const Vec3& p3 = vertices[triangles[i].v3].absolutePos;
+        bvh.itemMin[i] = Vec3(std::min({p1.x, p2.x, p3.x}), std::min({p1.y, p2.y, p3.y}), std::min({p1.z, p2.z, p3.z}));
+        bvh.itemMax[i] = Vec3(std::max({p1.x, p2.x, p3.x}), std::max({p1.y, p2.y, p3.y}), std::max({p1.z, p2.z, p3.z}));
+    }
+    bvh.build();
+}
+bool Object3D::isInFrustum(const Camera& cam, float aspect) const {
+    return cam.isSphereInFrustum(boundsCenter, boundsRadius, aspect);
+}
+void Object3D::addLevelOfDetail(Object3D mesh, float maxScreenRadius) {
+    if (!levelOfDetailMaxRadius.empty() && maxScreenRadius >= levelOfDetailMaxRadius.back()) {
+        std::cout << "Object3D::addLevelOfDetail() failed, levels must get coarser. INPUTS: maxScreenRadius = " << maxScreenRadius <<
+        ", previous maxScreenRadius = " << levelOfDetailMaxRadius.back() << std::endl;
+        throw "levels of detail out of order";
+    }
+    // picking reads the id from the visibility buffer, so every level must answer as this object
+    mesh.id = id;
+    mesh.isDeletable = isDeletable;
+    mesh.levelsOfDetail.clear();
+    mesh.levelOfDetailMaxRadius.clear();
+    levelsOfDetail.push_back(mesh);
+    levelOfDetailMaxRadius.push_back(maxScreenRadius);
+}
+Object3D& Object3D::getLevelOfDetail(const Camera& cam, const Window& window) {
+    if (levelsOfDetail.empty()) {
+        return *this;
+    }
+    // by distance rather than depth, so only moving switches levels and turning the camera doesn't
+    Vec3 toCenter = boundsCenter - cam.pos;
+    float distance = toCenter.mag();
+    if (distance <= boundsRadius) {
+        return *this;
+    }
+    float screenRadius = boundsRadius / (distance * cam.maxPlaneCoord) * 0.5f * window.width;
+    for (int i = levelsOfDetail.size() - 1; i >= 0; i--) {
+        if (screenRadius <= levelOfDetailMaxRadius[i]) {
+            return levelsOfDetail[i];
+        }
+    }
+    return *this;
+}
+void Object3D::transformVertices(const Camera& cam, const Window& window, threads::TaskGroup& tasks) {
+    // vertex stage, must be finished before drawMultithreaded() is called with the same camera.
+    // Only the level of detail drawn this frame is transformed, objects outside the frustum keep stale
+    // camera positions and drawMultithreaded() skips them too
+    Object3D& mesh = getLevelOfDetail(cam, window);
+    if (!mesh.isInFrustum(cam, (float) window.height / window.width)) {
+        return;
     }
+    threads::parallelFor(tasks, 0, mesh.vertices.size(), VERTEX_BATCH_SIZE, [&cam, &window, &mesh](int start, int end) {
+        cam.transformPoints(&mesh.vertices[start], end - start, window.width, window.height);
+    });
 }
-
-// STATIC METHODS
-void Object3D::removeObject(const Object3D& object) {
-    if (!object.isDeletable) {
+void Object3D::drawMultithreaded(Camera& cam, Window& window, threads::TaskGroup& tasks) {
+    // the whole object is off screen, or hidden behind what has already been rasterized this frame
+    Object3D& mesh = getLevelOfDetail(cam, window);
+    if (!mesh.isInFrustum(cam, (float) window.height / window.width) || window.isOccluded(mesh, cam)) {
         return;
     }
-    for (int i = 0; i < objects.size(); i++) {
-        if (objects[i] == object) {
-            objects.erase(objects.begin() + i);
+    threads::parallelFor(tasks, 0, mesh.triangles.size(), TRIANGLE_BATCH_SIZE, [&cam, &window, &mesh](int start, int end) {
+        for (int i = start; i < end; i++) {
+            mesh.triangles[i].draw(cam, window, mesh);
+        }
+    });
+}
+bool Object3D::intersectRay(const Vec3& origin, const Vec3& direction, float& maxDistance, int& triangleIndex, bool anyHit) const {
+    bool hit = false;
+    bvh.traverseRay(origin, direction, maxDistance, [&](int i) {
+        // Moller-Trumbore
+        const Vec3& a = vertices[triangles[i].v1].absolutePos;
+        Vec3 edge1 = vertices[triangles[i].v2].absolutePos - a;
+        Vec3 edge2 = vertices[triangles[i].v3].absolutePos - a;
+        Vec3 p = direction.cross(edge2);
+        float determinant = edge1.dot(p);
+        if (determinant == 0) {
+            return;
+        }
+        float determinantInv = 1 / determinant;
+        Vec3 s = origin - a;
+        float u = s.dot(p) * determinantInv;
+        if (u < 0 || u > 1) {
             return;
         }
+        Vec3 q = s.cross(edge1);
+        float v = direction.dot(q) * determinantInv;
+        if (v < 0 || u + v > 1) {
+            return;
+        }
+        float distance = edge2.dot(q) * determinantInv;
+        if (distance > 0 && distance < maxDistance) {
+            // nothing is nearer than 0, so the traversal stops right away
+            maxDistance = anyHit ? 0 : distance;
+            triangleIndex = i;
+            hit = true;
+        }
+    });
+    return hit;
+}
+
+// STATIC METHODS
+void Object3D::addObject(const Object3D& object) {
+    objects.push_back(object);
+    sceneBVH.insert(object.boundsMin, object.boundsMax);
+}
+bool Object3D::removeObject(int id) {
+    for (int i = 0; i < (int) objects.size(); i++) {
+        if (objects[i].id == id) {
+            if (!objects[i].isDeletable) {
+                return false;
+            }
+            objects.erase(objects.begin() + i);
+            sceneBVH.remove(i);
+            return true;
+        }
     }
+    return false;
+}
+bool Object3D::raycast(const Vec3& origin, const Vec3& direction, float maxDistance, RayHit& hit) {
+    hit.distance = maxDistance;
+    hit.objectIndex = -1;
+    hit.triangleIndex = -1;
+    // every object hit lowers hit.distance, which the traversal reads to skip everything behind it
+    sceneBVH.traverseRay(origin, direction, hit.distance, [&](int objectIndex) {
+        int triangleIndex;
+        if (objects[objectIndex].intersectRay(origin, direction, hit.distance, triangleIndex)) {
+            hit.objectIndex = objectIndex;
+            hit.triangleIndex = triangleIndex;
+        }
+    });
+    return hit.objectIndex >= 0;
+}
+bool Object3D::isOccluded(const Vec3& origin, const Vec3& direction, float maxDistance) {
+    // the first hit ends both traversals, the limit drops to 0 and nothing else can pass it
+    bool occluded = false;
+    sceneBVH.traverseRay(origin, direction, maxDistance, [&](int objectIndex) {
+        int triangleIndex;
+        if (!occluded && objects[objectIndex].intersectRay(origin, direction, maxDistance, triangleIndex, true)) {
+            occluded = true;
+        }
+    });
+    return occluded;
 }
 
 // Making new objects
@@ -494,66 +954,84 @@ Object3D Object3D::buildCube(Vec3 center, float sideLength, int red, int green,
     Vec3 g(center.x + halfSide, center.y - halfSide, center.z + halfSide);
     Vec3 h(center.x - halfSide, center.y - halfSide, center.z + halfSide);
 
+    int va = cube.addVertex(a);
+    int vb = cube.addVertex(b);
+    int vc = cube.addVertex(c);
+    int vd = cube.addVertex(d);
+    int ve = cube.addVertex(e);
+    int vf = cube.addVertex(f);
+    int vg = cube.addVertex(g);
+    int vh = cube.addVertex(h);
+
     // front face
-    cube.triangles.push_back(Triangle(a, e, h, red, green, blue));
-    cube.triangles.push_back(Triangle(h, d, a, red, green, blue));
+    cube.addTriangle(va, ve, vh, red, green, blue);
+    cube.addTriangle(vh, vd, va, red, green, blue);
 
     // back face
-    cube.triangles.push_back(Triangle(c, g, f, red, green, blue));
-    cube.triangles.push_back(Triangle(f, b, c, red, green, blue));
+    cube.addTriangle(vc, vg, vf, red, green, blue);
+    cube.addTriangle(vf, vb, vc, red, green, blue);
 
     // left face
-    cube.triangles.push_back(Triangle(d, h, g, red, green, blue));
-    cube.triangles.push_back(Triangle(g, c, d, red, green, blue));
+    cube.addTriangle(vd, vh, vg, red, green, blue);
+    cube.addTriangle(vg, vc, vd, red, green, blue);
 
     // right face
-    cube.triangles.push_back(Triangle(b, f, e, red, green, blue));
-    cube.triangles.push_back(Triangle(e, a, b, red, green, blue));
+    cube.addTriangle(vb, vf, ve, red, green, blue);
+    cube.addTriangle(ve, va, vb, red, green, blue);
 
     // top face
-    cube.triangles.push_back(Triangle(e, f, g, red, green, blue));
-    cube.triangles.push_back(Triangle(g, h, e, red, green, blue));
+    cube.addTriangle(ve, vf, vg, red, green, blue);
+    cube.addTriangle(vg, vh, ve, red, green, blue);
 
     // bottom face
-    cube.triangles.push_back(Triangle(c, b, a, red, green, blue));
-    cube.triangles.push_back(Triangle(a, d ,c, red, green, blue));
+    cube.addTriangle(vc, vb, va, red, green, blue);
+    cube.addTriangle(va, vd, vc, red, green, blue);
 
+    cube.updateBounds();
     return cube;
 }
 Object3D Object3D::buildCube(Vec3 center, float sideLength) {
     return buildCube(center, sideLength, 255, 255, 255);
 }
-Object3D Object3D::buildSphere(Vec3 center, float radius, int iterations, int r, int g, int b) {
+static Object3D buildSphereMesh(Vec3 center, float radius, int iterations, int r, int g, int b) {
     Object3D sphere;
-    std::vector<graphics::Vec3> prev(iterations);
-    std::vector<graphics::Vec3> curr(iterations);
+    // index of the first vertex of the previous and current ring, neighbouring rings share their vertices
+    int prev = 0;
+    int curr = 0;
+    int ringSize = 0;
     bool onFirst = true;
     for (float thetaY = -M_PI / 2.0; thetaY <= M_PI / 2.0; thetaY += M_PI / iterations) {
         prev = curr;
-        curr.clear();
+        curr = sphere.vertices.size();
         for (float thetaZ = 0; thetaZ <= 2 * M_PI; thetaZ += 2 * M_PI / iterations) {
             graphics::Vec3 v(std::cos(thetaY) * std::cos(thetaZ), std::cos(thetaY) * std::sin(thetaZ), std::sin(thetaY));
             v *= radius / 2;
             v += center;
-            curr.push_back(v);
+            sphere.addVertex(v);
         }
+        ringSize = sphere.vertices.size() - curr;
         if (onFirst) {
             onFirst = false;
             continue;
         }
-        for (int i = 0; i < prev.size(); i++) {
-            graphics::Triangle t1(prev[i], curr[i], curr[(i + 1) % iterations], r, g, b);
-            graphics::Triangle t2(prev[(i + 1) % iterations], prev[i], curr[(i + 1) % iterations], r, g, b);
-            t1.r = 255;
-            t1.g = 255;
-            t1.b = 255;
-            t2.r = 255;
-            t2.g = 255;
-            t2.b = 255;
-            sphere.triangles.push_back(t1);
-            sphere.triangles.push_back(t2);
+        for (int i = 0; i < ringSize; i++) {
+            int next = (i + 1) % iterations;
+            sphere.addTriangle(prev + i, curr + i, curr + next, r, g, b);
+            sphere.addTriangle(prev + next, prev + i, curr + next, r, g, b);
         }
     }
+    sphere.updateBounds();
+    return sphere;
+}
+Object3D Object3D::buildSphere(Vec3 center, float radius, int iterations, int r, int g, int b) {
+    Object3D sphere = buildSphereMesh(center, radius, iterations, r, g, b);
+    // every level halves the iterations. A level is drawn while its edges, 2 pi screenRadius / iterations long,
+    // stay within LOD_EDGE_PIXELS. It is scaled up until its faces are outside the full sphere, which casts the
+    // shadows, so the points drawn are never behind the surface the shadow map or shadow rays see
+    for (int levelIterations = iterations / 2; levelIterations >= MIN_SPHERE_ITERATIONS; levelIterations /= 2) {
+        float scale = 1 / (cos(M_PI / (2 * levelIterations)) * cos(M_PI / levelIterations));
+        sphere.addLevelOfDetail(buildSphereMesh(center, radius * scale, levelIterations, r, g, b), levelIterations * LOD_EDGE_PIXELS / (2 * M_PI));
+    }
     return sphere;
 }
 Object3D Object3D::buildSphere(Vec3 center, float radius, int iterations) {
@@ -583,6 +1061,9 @@ Camera::Camera(Vec3 pos, float thetaZ, float thetaY, float fov) {
     this->costhetaY = cos(thetaY);
     this->costhetaZ = cos(thetaZ);
     this->maxPlaneCoordInv = 1 / this->maxPlaneCoord;
+    this->lookingAtObjectId = 0;
+    this->lookingAtDepth = 0;
+    updateMatrices();
 }
 Camera::Camera() : Camera(Vec3(0,0,0), 0, 0, 90) {
 }
@@ -593,6 +1074,7 @@ void Camera::moveRelative(float forward, float sideward, float upward) {
     sideDirection.rotate(-M_PI / 2, 0);
     pos += floorDirection * forward + sideDirection * sideward;
     pos.z += upward;
+    updateMatrices();
 }
 void Camera::rotate(float thetaZ, float thetaY) {
     this->thetaZ += thetaZ;
@@ -610,6 +1092,71 @@ void Camera::rotate(float thetaZ, float thetaY) {
     this->sinthetaZ = sin(this->thetaZ);
     this->costhetaY = cos(this->thetaY);
     this->costhetaZ = cos(this->thetaZ);
+    updateMatrices();
+}
+void Camera::updateMatrices() {
+    view = Mat4::rotationYKnownTrig(-sinthetaY, costhetaY) * Mat4::rotationZKnownTrig(-sinthetaZ, costhetaZ) * Mat4::translation(pos * -1);
+    inverseView = Mat4::translation(pos) * Mat4::rotationZKnownTrig(sinthetaZ, costhetaZ) * Mat4::rotationYKnownTrig(sinthetaY, costhetaY);
+
+    // camera space (x, y, z) -> (y / maxPlaneCoord, z / maxPlaneCoord, 1, x), and back
+    Mat4 projection;
+    projection.m[0][0] = 0; projection.m[0][1] = maxPlaneCoordInv;
+    projection.m[1][1] = 0; projection.m[1][2] = maxPlaneCoordInv;
+    projection.m[2][2] = 0; projection.m[2][3] = 1;
+    projection.m[3][3] = 0; projection.m[3][0] = 1;
+    Mat4 inverseProjection;
+    inverseProjection.m[0][0] = 0; inverseProjection.m[0][3] = 1;
+    inverseProjection.m[1][1] = 0; inverseProjection.m[1][0] = maxPlaneCoord;
+    inverseProjection.m[2][2] = 0; inverseProjection.m[2][1] = maxPlaneCoord;
+    inverseProjection.m[3][3] = 0; inverseProjection.m[3][2] = 1;
+
+    viewProjection = projection * view;
+    inverseViewProjection = inverseView * inverseProjection;
+}
+void Camera::transformPoints(Point* points, int count, int width, int height) const {
+    // same result as Point::calculateAll for every point, done in batches of structure-of-arrays with SIMD
+    const int BATCH = 64;
+    alignas(16) float x[BATCH], y[BATCH], z[BATCH], cameraX[BATCH], cameraY[BATCH], cameraZ[BATCH];
+    alignas(16) float projectedX[BATCH], projectedY[BATCH], projectedZ[BATCH], screenX[BATCH], screenY[BATCH], dist[BATCH];
+    simd::Float4 halfWidth = simd::set1(0.5f * width);
+    simd::Float4 halfHeight = simd::set1(0.5f * height);
+    simd::Float4 screenYScale = simd::set1(0.5f * maxPlaneCoordInv * width);
+    simd::Float4 planeInv = simd::set1(maxPlaneCoordInv);
+    simd::Float4 half = simd::set1(0.5f);
+    simd::Float4 one = simd::set1(1);
+    simd::Float4 zero = simd::set1(0);
+    for (int start = 0; start < count; start += BATCH) {
+        int n = std::min(BATCH, count - start);
+        // pad to a multiple of 4 by repeating the last point, the padding is never written back
+        int padded = (n + 3) & ~3;
+        for (int i = 0; i < padded; i++) {
+            const Vec3& pos = points[start + std::min(i, n - 1)].absolutePos;
+            x[i] = pos.x;
+            y[i] = pos.y;
+            z[i] = pos.z;
+        }
+        view.transformPoints(padded, x, y, z, cameraX, cameraY, cameraZ, nullptr);
+        for (int i = 0; i < padded; i += 4) {
+            simd::Float4 cx = simd::load(cameraX + i);
+            simd::Float4 cy = simd::load(cameraY + i);
+            simd::Float4 cz = simd::load(cameraZ + i);
+            simd::Float4 px = cy / cx;
+            simd::Float4 py = cz / cx;
+            simd::store(projectedX + i, px);
+            simd::store(projectedY + i, py);
+            simd::store(projectedZ + i, simd::select(simd::cmpgt(cx, zero), one, zero - one));
+            simd::store(screenX + i, halfWidth * (one - px * planeInv) - half);
+            simd::store(screenY + i, halfHeight - py * screenYScale - half);
+            simd::store(dist + i, simd::sqrt(cx * cx + cy * cy + cz * cz));
+        }
+        for (int i = 0; i < n; i++) {
+            Point& p = points[start + i];
+            p.cameraPos = Vec3(cameraX[i], cameraY[i], cameraZ[i]);
+            p.projectedPos = Vec3(projectedX[i], projectedY[i], projectedZ[i]);
+            p.screenPos = Vec3(screenX[i], screenY[i], 0);
+            p.distToCamera = dist[i];
+        }
+    }
 }
 float Camera::getCameraYFromPixel(int x, int width) const {
     return - maxPlaneCoord * (x - (0.5 * width) + 0.5) / (0.5 * width);
@@ -617,19 +1164,34 @@ float Camera::getCameraYFromPixel(int x, int width) const {
 float Camera::getCameraZFromPixel(int y, int height) const {
     return - maxPlaneCoord * (y - (0.5 * height) + 0.5) / (0.5 * height);
 }
-float Camera::getCameraYFromPixelFast(int x, float widthInv) const {
-    return - maxPlaneCoord * ((2 * x + 1.0) * widthInv - 1);
-}
-float Camera::getCameraZFromPixelFast(int y, float heightInv) const {
-    return - maxPlaneCoord * ((2 * y + 1.0) * heightInv - 1);
+bool Camera::isSphereInFrustum(const Vec3& center, float radius, float aspect) const {
+    // in camera space the side planes are |y| = x * maxPlaneCoord and |z| = x * maxPlaneCoord * aspect,
+    // the sphere is outside when its center is more than radius beyond one of them or before the near plane
+    float cameraPos[4];
+    view.transform(center.x, center.y, center.z, 1, cameraPos);
+    float x = cameraPos[0], y = cameraPos[1], z = cameraPos[2];
+    if (x + radius < NEAR_PLANE) {
+        return false;
+    }
+    float slopeY = maxPlaneCoord;
+    float slopeZ = maxPlaneCoord * aspect;
+    if (fabs(y) - x * slopeY > radius * sqrt(1 + slopeY * slopeY)) {
+        return false;
+    }
+    if (fabs(z) - x * slopeZ > radius * sqrt(1 + slopeZ * slopeZ)) {
+        return false;
+    }
+    return true;
 }
-Vec3 Camera::getCenterOfViewPosition(Window& window) const {
-    float depth = window.zBuffer.getDepth(window.width * 0.5, window.height * 0.5);
+Vec3 Camera::getCenterOfViewPosition() const {
+    float depth = lookingAtObjectId != 0 ? lookingAtDepth : 99999;
     return pos + direction * depth;
 }
-Vec3 Camera::getPositionOfNewObject(Window& window) const {
-    Vec3 viewCenter = getCenterOfViewPosition(window);
-    viewCenter += 0.5 * lookingAtTriangle->absoluteNormal;
+Vec3 Camera::getPositionOfNewObject() const {
+    Vec3 viewCenter = getCenterOfViewPosition();
+    if (lookingAtObjectId != 0) {
+        viewCenter += 0.5 * lookingAtNormal;
+    }
     viewCenter.x = round(viewCenter.x + 0.5) - 0.5;
     viewCenter.y = round(viewCenter.y + 0.5) - 0.5;
     viewCenter.z = round(viewCenter.z + 0.5) - 0.5;
@@ -639,32 +1201,12 @@ Vec3 Camera::getPositionOfNewObject(Window& window) const {
 
 //-----------------------------------------------------------------------------------
 // IMPLEMENTATION OF "PixelArray"
-PixelArrayData::PixelArrayData(int r, int g, int b) {
-    this->r = r;
-    this->g = g;
-    this->b = b;
-}
-PixelArrayData::PixelArrayData(int color) {
-    this->r = color;
-    this->g = color;
-    this->b = color;
-}
-PixelArrayData::PixelArrayData(const PixelArrayData& other) {
-    this->r = other.r;
-    this->g = other.g;
-    this->b = other.b;
-}
-PixelArrayData::PixelArrayData() {
-    this->r = 0;
-    this->g = 0;
-    this->b = 0;
-}
 
 // CONSTRUCTOR
 PixelArray::PixelArray(int width, int height) {
     this->width = width;
     this->height = height;
-    data = std::vector<PixelArrayData>(width * height);
+    data = std::vector<uint32_t>(width * height, packColor(0, 0, 0));
 }
 
 // METHODS
@@ -681,63 +1223,53 @@ void PixelArray::setPixel(int x, int y, int color) {
         std::cout << "PixelArray::setPixel() failed, color value out of bounds. INPUTS: color = " << color << std::endl;
         throw "color value out of bounds";
     }
-    int index = this->getIndex(x, y);
-    {
-        std::lock_guard<std::mutex> lock(data[index].mutex);
-        data[index].r = color;
-        data[index].g = color;
-        data[index].b = color;
-    }
+    data[getIndex(x, y)] = packColor(color, color, color);
 }
 void PixelArray::setPixel(int x, int y, int r, int g, int b) {
     if (r < 0 || g < 0 || b < 0 || r > 255 || g > 255 || b > 255) {
         std::cout << "PixelArray::setPixel() failed, color value out of bounds. INPUTS: r, g, b = " << r << ", " << g << ", " << b << std::endl;
         throw "color value out of bounds";
     }
-    int index = this->getIndex(x, y);
-    {
-        std::lock_guard<std::mutex> lock(data[index].mutex);
-        data[index].r = r;
-        data[index].g = g;
-        data[index].b = b;
-    }
-}
-void PixelArray::clear() {
-    for (int i = 0; i < data.size(); i += width) {
-        threads::threadPool.addTask([i, this] {
-            for (int j = i; j < i + width; j++) {
-                data[j].r = 0;
-                data[j].g = 0;
-                data[j].b = 0;   
-            }
-        });
-    }
+    data[getIndex(x, y)] = packColor(r, g, b);
+}
+void PixelArray::clear(threads::TaskGroup& tasks) {
+    uint32_t black = packColor(0, 0, 0);
+    threads::parallelFor(tasks, 0, data.size(), CLEAR_BATCH_SIZE, [this, black](int start, int end) {
+        std::fill(data.begin() + start, data.begin() + end, black);
+    });
+}
+size_t PixelArray::getMemoryUsage() const {
+    return data.capacity() * sizeof(uint32_t);
+}
 
-    for (int i = 0; i < data.size(); i++) {
-        data[i].r = 0;
-        data[i].g = 0;
-        data[i].b = 0;
-    }
+// STATIC METHODS
+uint32_t PixelArray::packColor(int r, int g, int b) {
+    return (uint32_t) r | ((uint32_t) g << 8) | ((uint32_t) b << 16) | (255u << 24);
 }
 
 
 //-----------------------------------------------------------------------------------
 // IMPLEMENTATION OF "ZBuffer"
-ZBufferData::ZBufferData(float depth) {
-    this->depth = depth;
-}
-ZBufferData::ZBufferData(const ZBufferData& other) {
-    this->depth = other.depth;
-}
-ZBufferData::ZBufferData() {
-    this->depth = 99999;
-}
 
 // CONSTRUCTOR
-ZBuffer::ZBuffer(int width, int height) {
+ZBuffer::ZBuffer(int width, int height, Format format, float maxInverseDepth) {
+    if (width <= 0 || height <= 0) {
+        std::cout << "ZBuffer::ZBuffer() failed, size must be positive. INPUTS: width = " << width << ", height = " << height << std::endl;
+        throw "invalid size";
+    }
+    if (!(maxInverseDepth > 0)) {
+        std::cout << "ZBuffer::ZBuffer() failed, maxInverseDepth must be positive. INPUTS: maxInverseDepth = " << maxInverseDepth << std::endl;
+        throw "invalid maxInverseDepth";
+    }
     this->width = width;
     this->height = height;
-    data = std::vector<ZBufferData>(width * height);
+    this->format = format;
+    this->maxInverseDepth = maxInverseDepth;
+    if (format == FLOAT32) {
+        data = std::vector<float>(width * height, CLEAR_INVERSE_DEPTH);
+    } else {
+        data16 = std::vector<uint16_t>(width * height, encodeUnorm16(CLEAR_INVERSE_DEPTH));
+    }
 }
 
 // METHODS
@@ -749,28 +1281,256 @@ int ZBuffer::getIndex(int x, int y) {
     }
     return ((this->width * y) + x);
 }
-void ZBuffer::setDepth(int x, int y, float depth) {
-    if (depth < 0) {
-        std::cout << "ZBuffer::setDepth() failed, depth value out of bounds. INPUTS: depth = " << depth << std::endl; 
+void ZBuffer::setInverseDepth(int x, int y, float inverseDepth) {
+    if (inverseDepth < 0) {
+        std::cout << "ZBuffer::setInverseDepth() failed, depth value out of bounds. INPUTS: inverseDepth = " << inverseDepth << std::endl; 
         throw "invalid depth";
     }
     int index = getIndex(x, y);
-    {
-        std::lock_guard<std::mutex> lock(data[index].mutex);
-        data[index].depth = depth;
+    if (format == FLOAT32) {
+        data[index] = inverseDepth;
+    } else {
+        data16[index] = encodeUnorm16(inverseDepth);
     }
 }
-float ZBuffer::getDepth(int x, int y) {
+float ZBuffer::getInverseDepth(int x, int y) {
     int index = getIndex(x, y);
-    return data[index].depth;
+    return format == FLOAT32 ? data[index] : decodeUnorm16(data16[index]);
 }
-void ZBuffer::clear() {
-    for (int i = 0; i < data.size(); i += width) {
-        threads::threadPool.addTask([i, this] {
-            for (int j = i; j < i + width; j++) {
-                data[j].depth = 99999;
+void ZBuffer::clear(threads::TaskGroup& tasks) {
+    clear(tasks, 0, width - 1, 0, height - 1);
+}
+void ZBuffer::clear(threads::TaskGroup& tasks, int left, int right, int bottom, int top) {
+    int rowsPerTask = std::max(1, CLEAR_BATCH_SIZE / (right - left + 1));
+    threads::parallelFor(tasks, bottom, top + 1, rowsPerTask, [this, left, right](int start, int end) {
+        for (int y = start; y < end; y++) {
+            if (format == FLOAT32) {
+                std::fill(data.begin() + width * y + left, data.begin() + width * y + right + 1, CLEAR_INVERSE_DEPTH);
+            } else {
+                std::fill(data16.begin() + width * y + left, data16.begin() + width * y + right + 1, encodeUnorm16(CLEAR_INVERSE_DEPTH));
             }
-        });
+        }
+    });
+}
+size_t ZBuffer::getMemoryUsage() const {
+    return data.capacity() * sizeof(float) + data16.capacity() * sizeof(uint16_t);
+}
+uint16_t ZBuffer::encodeUnorm16(float inverseDepth) const {
+    // rounding down only ever moves a surface away, which errs on the side of lit for shadow maps
+    float value = inverseDepth * (65535 / maxInverseDepth);
+    return value >= 65535 ? 65535 : value > 0 ? (uint16_t) value : 0;
+}
+float ZBuffer::decodeUnorm16(uint16_t value) const {
+    return value * (maxInverseDepth / 65535);
+}
+
+
+//-----------------------------------------------------------------------------------
+// IMPLEMENTATION OF "VisibilityBuffer"
+
+// CONSTRUCTOR
+VisibilityBuffer::VisibilityBuffer(int width, int height) {
+    this->width = width;
+    this->height = height;
+    triangles = std::vector<const Triangle*>(width * height, nullptr);
+    objects = std::vector<const Object3D*>(width * height, nullptr);
+}
+
+// METHODS
+void VisibilityBuffer::clear(threads::TaskGroup& tasks) {
+    threads::parallelFor(tasks, 0, triangles.size(), CLEAR_BATCH_SIZE, [this](int start, int end) {
+        std::fill(triangles.begin() + start, triangles.begin() + end, nullptr);
+        std::fill(objects.begin() + start, objects.begin() + end, nullptr);
+    });
+}
+size_t VisibilityBuffer::getMemoryUsage() const {
+    return triangles.capacity() * sizeof(const Triangle*) + objects.capacity() * sizeof(const Object3D*);
+}
+
+
+//-----------------------------------------------------------------------------------
+// IMPLEMENTATION OF "EdgeRasterizer"
+bool EdgeRasterizer::setup(const Vec3& a, const Vec3& b, const Vec3& c, const Vec3& normal, float d1, const Camera& cam, int width, int height) {
+    // snap to the subpixel grid. Shared corners have the same screen position in both triangles, so they snap the same
+    const Vec3* corners[3] = {&a, &b, &c};
+    const float subpixels = 1 << SUBPIXEL_BITS;
+    int64_t x[3], y[3];
+    for (int i = 0; i < 3; i++) {
+        // also rejects NaN coordinates
+        if (!(std::fabs(corners[i]->x) <= GUARD_BAND && std::fabs(corners[i]->y) <= GUARD_BAND)) {
+            return false;
+        }
+        x[i] = std::llround(corners[i]->x * subpixels);
+        y[i] = std::llround(corners[i]->y * subpixels);
+    }
+    int64_t area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+    if (area == 0) {
+        return false;
+    }
+
+    // wind the triangle so that all three edge functions are positive inside it
+    int order[3] = {0, 1, 2};
+    if (area < 0) {
+        std::swap(order[1], order[2]);
+    }
+    for (int i = 0; i < 3; i++) {
+        int from = order[i];
+        int to = order[(i + 1) % 3];
+        // swapping from and to negates all three exactly, which is what the neighbour across the edge does
+        edgeA[i] = y[from] - y[to];
+        edgeB[i] = x[to] - x[from];
+        edgeC[i] = x[from] * y[to] - x[to] * y[from];
+        // the inside is to the right of a left edge, and below a top edge since y grows downwards.
+        // Exactly one of the two triangles sharing an edge sees it as top or left
+        edgeTopLeft[i] = edgeA[i] > 0 || (edgeA[i] == 0 && edgeB[i] > 0);
+    }
+
+    minX = std::min({x[0], x[1], x[2]}) / subpixels;
+    maxX = std::max({x[0], x[1], x[2]}) / subpixels;
+    minY = std::min({y[0], y[1], y[2]}) / subpixels;
+    maxY = std::max({y[0], y[1], y[2]}) / subpixels;
+
+    // a plane through the camera is seen edge-on and covers no pixels
+    if (d1 == 0) {
+        return false;
+    }
+    // same as Camera::getCameraYFromPixel and Camera::getCameraZFromPixel, written as linear functions
+    float cameraYX = -2 * cam.maxPlaneCoord / width;
+    float cameraYC = -cam.maxPlaneCoord * (1.0f / width - 1);
+    float cameraZY = -2 * cam.maxPlaneCoord / height;
+    float cameraZC = -cam.maxPlaneCoord * (1.0f / height - 1);
+    // the point on the plane along ray = (1, cameraY, cameraZ) is ray * d1 / (normal . ray)
+    float d1Inv = 1 / d1;
+    inverseDepthA = normal.y * cameraYX * d1Inv;
+    inverseDepthB = normal.z * cameraZY * d1Inv;
+    inverseDepthC = (normal.x + normal.y * cameraYC + normal.z * cameraZC) * d1Inv;
+    return true;
+}
+
+template <typename FragmentFunc>
+void EdgeRasterizer::rasterize(ZBuffer& zBuffer, int left, int right, int bottom, int top, bool skipDepthTest, FragmentFunc onFragment) const {
+    using namespace simd;
+
+    // only visit blocks inside both the bounding box and the given rectangle
+    left = std::max(left, (int) std::max(std::ceil(minX), -1.0f));
+    right = std::min(right, (int) std::min(std::floor(maxX), (float) zBuffer.width));
+    bottom = std::max(bottom, (int) std::max(std::ceil(minY), -1.0f));
+    top = std::min(top, (int) std::min(std::floor(maxY), (float) zBuffer.height));
+    if (left > right || bottom > top) {
+        return;
+    }
+
+    const Float4 laneOffsets = set(0, 1, 2, 3);
+    const Float4 zero = set1(0);
+    // the edge test is edge > bias, which also takes pixel centers exactly on a top or left edge
+    const Int4 edgeBias[3] = {set1i(edgeTopLeft[0] ? -1 : 0), set1i(edgeTopLeft[1] ? -1 : 0), set1i(edgeTopLeft[2] ? -1 : 0)};
+    const int64_t pixel = 1 << SUBPIXEL_BITS;
+    const int64_t span = (BLOCK_SIZE - 1) * pixel;
+    const bool isFloat = zBuffer.format == ZBuffer::FLOAT32;
+
+    // coverage and depth are evaluated from the pixel position alone, so every pixel gets exactly the same values
+    // no matter which rectangle is drawn
+    int blockLeft = left - left % BLOCK_SIZE;
+    for (int blockY = bottom; blockY <= top; blockY += BLOCK_SIZE) {
+        int rowEnd = std::min(blockY + BLOCK_SIZE - 1, top);
+        for (int blockX = blockLeft; blockX <= right; blockX += BLOCK_SIZE) {
+            // trivial reject and trivial accept using the extremes of each edge function over the block.
+            // An edge that crosses the block spans less than 2^31 over it within the guard band, so its values
+            // fit 32 bit lanes. Edges the whole block is inside of always pass, whatever their values
+            bool fullyCovered = true;
+            bool rejected = false;
+            int32_t edgeOrigin[3], edgeStepX[3], edgeStepY[3];
+            for (int i = 0; i < 3; i++) {
+                int64_t origin = edgeA[i] * (blockX * pixel) + edgeB[i] * (blockY * pixel) + edgeC[i];
+                int64_t edgeMax = origin + std::max(edgeA[i], (int64_t) 0) * span + std::max(edgeB[i], (int64_t) 0) * span;
+                int64_t edgeMin = origin + std::min(edgeA[i], (int64_t) 0) * span + std::min(edgeB[i], (int64_t) 0) * span;
+                if (edgeMax < 0) {
+                    rejected = true;
+                    break;
+                }
+                if (edgeMin > 0) {
+                    edgeOrigin[i] = 1;
+                    edgeStepX[i] = edgeStepY[i] = 0;
+                } else {
+                    fullyCovered = false;
+                    edgeOrigin[i] = (int32_t) origin;
+                    edgeStepX[i] = (int32_t) (edgeA[i] * pixel);
+                    edgeStepY[i] = (int32_t) (edgeB[i] * pixel);
+                }
+            }
+            if (rejected) {
+                continue;
+            }
+            Int4 edgeX[3];
+            for (int i = 0; i < 3; i++) {
+                edgeX[i] = seti(0, edgeStepX[i], 2 * edgeStepX[i], 3 * edgeStepX[i]);
+            }
+
+            // lanes outside of [left, right] never produce fragments
+            bool fullBlock = blockX >= left && blockX + BLOCK_SIZE - 1 <= right;
+            int laneBits = 0;
+            for (int i = 0; i < BLOCK_SIZE; i++) {
+                if (blockX + i >= left && blockX + i <= right) {
+                    laneBits |= 1 << i;
+                }
+            }
+            Float4 inverseDepthX = set1(inverseDepthA) * (set1(blockX) + laneOffsets);
+
+            for (int y = blockY; y <= rowEnd; y++) {
+                int coverageBits = laneBits;
+                if (!fullyCovered) {
+                    int rowInBlock = y - blockY;
+                    Int4 inside = cmpgt(set1i(edgeOrigin[0] + edgeStepY[0] * rowInBlock) + edgeX[0], edgeBias[0]);
+                    inside = inside & cmpgt(set1i(edgeOrigin[1] + edgeStepY[1] * rowInBlock) + edgeX[1], edgeBias[1]);
+                    inside = inside & cmpgt(set1i(edgeOrigin[2] + edgeStepY[2] * rowInBlock) + edgeX[2], edgeBias[2]);
+                    coverageBits &= movemask(inside);
+                    if (coverageBits == 0) {
+                        continue;
+                    }
+                }
+
+                Float4 inverseDepth = inverseDepthX + set1(inverseDepthB * y + inverseDepthC);
+                // only one of the two is used, depending on the format
+                float* row = isFloat ? &zBuffer.data[zBuffer.width * y] : nullptr;
+                uint16_t* row16 = isFloat ? nullptr : &zBuffer.data16[zBuffer.width * y];
+                // pixels behind the camera have a negative inverse depth
+                Float4 passed = cmpgt(inverseDepth, zero);
+                if (!skipDepthTest) {
+                    Float4 oldDepth;
+                    if (fullBlock && isFloat) {
+                        oldDepth = load(row + blockX);
+                    } else {
+                        float stored[BLOCK_SIZE];
+                        for (int i = 0; i < BLOCK_SIZE; i++) {
+                            int x = blockX + i;
+                            if (x < left || x > right) {
+                                stored[i] = 0;
+                            } else {
+                                stored[i] = isFloat ? row[x] : zBuffer.decodeUnorm16(row16[x]);
+                            }
+                        }
+                        oldDepth = load(stored);
+                    }
+                    passed = passed & cmpgt(inverseDepth, oldDepth);
+                }
+                int passedBits = movemask(passed) & coverageBits;
+                if (passedBits == 0) {
+                    continue;
+                }
+                float inverseDepths[BLOCK_SIZE];
+                store(inverseDepths, inverseDepth);
+                for (int i = 0; i < BLOCK_SIZE; i++) {
+                    if (passedBits & (1 << i)) {
+                        if (isFloat) {
+                            row[blockX + i] = inverseDepths[i];
+                        } else {
+                            row16[blockX + i] = zBuffer.encodeUnorm16(inverseDepths[i]);
+                        }
+                        onFragment(blockX + i, y, inverseDepths[i]);
+                    }
+                }
+            }
+        }
     }
 }
 
@@ -780,11 +1540,18 @@ void ZBuffer::clear() {
 
 // CONSTRUCTOR
 Window::Window(int width, int height)
- : pixelArray(width, height), zBuffer(width, height) {
+ : pixelArray(width, height), frontPixelArray(width, height), zBuffer(width, height), visibilityBuffer(width, height) {
     this->width = width;
     this->height = height;
     this->widthInv = 1.0 / width;
     this->heightInv = 1.0 / height;
+    this->numTilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    this->numTilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+    this->tileBins = std::vector<TileBin>(numTilesX * numTilesY);
+    this->tileMinInverseDepth = std::vector<float>(numTilesX * numTilesY, ZBuffer::CLEAR_INVERSE_DEPTH);
+    this->tileMaxInverseDepth = std::vector<float>(numTilesX * numTilesY, ZBuffer::CLEAR_INVERSE_DEPTH);
+    this->tileLights = std::vector<std::vector<int> >(numTilesX * numTilesY);
+    this->deferredShading = true;
 }
 
 void Window::drawPoint(Point& point) {
@@ -873,119 +1640,321 @@ void Window::drawLine(Line &line) {
     }
     
 }
-void Window::drawTriangle(Triangle &triangle, const Object3D& object, Camera& cam) {
-    Point a, b, c;
-    a = triangle.p1;
-    b = triangle.p2;
-    c = triangle.p3;
+void Window::drawTriangle(const Point& p1, const Point& p2, const Point& p3, const Vec3& cameraNormal, const Triangle& source, const Object3D& object, const Camera& cam) {
+    RasterTriangle rasterTriangle;
+    rasterTriangle.source = &source;
+    rasterTriangle.object = &object;
 
     // equation for plane
-    float d1 = triangle.cameraNormal.x * a.cameraPos.x + triangle.cameraNormal.y * a.cameraPos.y + triangle.cameraNormal.z * a.cameraPos.z;
-
-    // first make a = leftmost, b = middle, c = rightmost point
-    if (a.screenPos.x > b.screenPos.x) {
-        std::swap(a, b);
+    float d1 = cameraNormal.dot(p1.cameraPos);
+    if (!rasterTriangle.edges.setup(p1.screenPos, p2.screenPos, p3.screenPos, cameraNormal, d1, cam, width, height)) {
+        return;
     }
-    if (b.screenPos.x > c.screenPos.x) {
-        std::swap(b, c);
+
+    // pixel centers covered by the bounding box, pixel (x, y) is centered on screenPos (x, y)
+    float minX = rasterTriangle.edges.minX;
+    float maxX = rasterTriangle.edges.maxX;
+    float minY = rasterTriangle.edges.minY;
+    float maxY = rasterTriangle.edges.maxY;
+    if (maxX < 0 || minX > width - 1 || maxY < 0 || minY > height - 1) {
+        return;
     }
-    if (a.screenPos.x > b.screenPos.x) {
-        std::swap(a, b);
+    utils::clampToRange(minX, width - 1);
+    utils::clampToRange(maxX, width - 1);
+    utils::clampToRange(minY, height - 1);
+    utils::clampToRange(maxY, height - 1);
+
+    // depth is linear over a triangle, so its extremes are at the corners of the unclipped source triangle
+    float corner1 = object.vertices[source.v1].cameraPos.x;
+    float corner2 = object.vertices[source.v2].cameraPos.x;
+    float corner3 = object.vertices[source.v3].cameraPos.x;
+    float nearestCorner = std::min({corner1, corner2, corner3});
+    float farthestCorner = std::max({corner1, corner2, corner3});
+    rasterTriangle.maxInverseDepth = nearestCorner > 0 ? 1 / nearestCorner : INFINITY;
+    rasterTriangle.minInverseDepth = 1 / farthestCorner;
+    if (isOccluded(minX, maxX, minY, maxY, rasterTriangle.maxInverseDepth)) {
+        return;
     }
 
-    float dy_long = (c.screenPos.y - a.screenPos.y) / (c.screenPos.x - a.screenPos.x);
-    float dy1 = (b.screenPos.y - a.screenPos.y) / (b.screenPos.x - a.screenPos.x);
-    float dy2 = (c.screenPos.y - b.screenPos.y) / (c.screenPos.x - b.screenPos.x);
-
-    float left = a.screenPos.x;
-    float  mid = b.screenPos.x;
-    float right = c.screenPos.x;
-    utils::clampToRange(left, width - 1);
-    utils::clampToRange(mid, width - 1);
-    utils::clampToRange(right, width - 1);
-
-    // std::cout << left << ", " << mid << ", " << right << "\n";
+    // sort the triangle into every tile its bounding box touches
+    int tileLeft = (int) ceil(minX) / TILE_SIZE;
+    int tileRight = (int) floor(maxX) / TILE_SIZE;
+    int tileBottom = (int) ceil(minY) / TILE_SIZE;
+    int tileTop = (int) floor(maxY) / TILE_SIZE;
+    for (int tileY = tileBottom; tileY <= tileTop; tileY++) {
+        for (int tileX = tileLeft; tileX <= tileRight; tileX++) {
+            TileBin& bin = tileBins[tileY * numTilesX + tileX];
+            std::lock_guard<std::mutex> lock(bin.mutex);
+            bin.triangles.push_back(rasterTriangle);
+        }
+    }
+}
+void Window::rasterizeTiles(Camera& cam, threads::TaskGroup& tasks) {
+    // one task per tile, so every pixel is only ever touched by a single thread
+    for (int tileY = 0; tileY < numTilesY; tileY++) {
+        for (int tileX = 0; tileX < numTilesX; tileX++) {
+            if (tileBins[tileY * numTilesX + tileX].triangles.empty()) {
+                continue;
+            }
+            tasks.addTask([this, &cam, tileX, tileY] {
+                rasterizeTile(cam, tileX, tileY);
+            });
+        }
+    }
+}
+void Window::drawObjects(Camera& cam, std::vector<Object3D>& objects, threads::TaskGroup& tasks) {
+    // vertices must already be transformed. The nearest objects go first, in batches that are rasterized before
+    // the next batch is binned, so the hierarchical z left by earlier batches can reject whole objects and
+    // triangles hidden behind them. Distance is to the nearest point of the bounds
+    std::vector<std::pair<float, Object3D*> > order;
+    order.reserve(objects.size());
+    for (Object3D& object : objects) {
+        Vec3 nearest(
+            std::min(std::max(cam.pos.x, object.boundsMin.x), object.boundsMax.x),
+            std::min(std::max(cam.pos.y, object.boundsMin.y), object.boundsMax.y),
+            std::min(std::max(cam.pos.z, object.boundsMin.z), object.boundsMax.z)
+        );
+        Vec3 offset = nearest - cam.pos;
+        order.push_back({offset.dot(offset), &object});
+    }
+    std::stable_sort(order.begin(), order.end(), [](const std::pair<float, Object3D*>& a, const std::pair<float, Object3D*>& b) {
+        return a.first < b.first;
+    });
+
+    size_t next = 0;
+    while (next < order.size()) {
+        size_t batchTriangles = 0;
+        while (next < order.size() && batchTriangles < DRAW_BATCH_TRIANGLES) {
+            Object3D& object = *order[next].second;
+            object.drawMultithreaded(cam, *this, tasks);
+            batchTriangles += object.getLevelOfDetail(cam, *this).triangles.size();
+            next++;
+        }
+        tasks.wait();
+        rasterizeTiles(cam, tasks);
+        tasks.wait();
+    }
+}
+void Window::rasterizeTile(Camera& cam, int tileX, int tileY) {
+    int tileIndex = tileY * numTilesX + tileX;
+    TileBin& bin = tileBins[tileIndex];
+    int tileLeft = tileX * TILE_SIZE;
+    int tileRight = std::min(tileLeft + TILE_SIZE, width) - 1;
+    int tileBottom = tileY * TILE_SIZE;
+    int tileTop = std::min(tileBottom + TILE_SIZE, height) - 1;
+
+    // binning threads push in whatever order they finish, put the triangles back in the order the objects
+    // store them so ties in depth always go to the same one. Pieces of a triangle clipped by the near plane
+    // are pushed together by one thread and keep their order
+    std::stable_sort(bin.triangles.begin(), bin.triangles.end(), [](const RasterTriangle& a, const RasterTriangle& b) {
+        if (a.object->id != b.object->id) {
+            return a.object->id < b.object->id;
+        }
+        return a.source - a.object->triangles.data() < b.source - b.object->triangles.data();
+    });
+
+    // shading right away needs the lights now, the depth range of the binned triangles bounds what gets drawn
+    if (!deferredShading) {
+        float minInverseDepth = INFINITY;
+        float maxInverseDepth = 0;
+        for (const RasterTriangle& triangle : bin.triangles) {
+            minInverseDepth = std::min(minInverseDepth, triangle.minInverseDepth);
+            maxInverseDepth = std::max(maxInverseDepth, triangle.maxInverseDepth);
+        }
+        cullTileLights(cam, tileX, tileY, minInverseDepth, maxInverseDepth);
+    }
 
-    float y1, y2; // y1 for shorter line segment, y2 for longer line segment
-    int bottom, top;
-    y1 = a.screenPos.y + dy1 * (left - a.screenPos.x);
-    y2 = a.screenPos.y + dy_long * (left - a.screenPos.x);
-    for (float x = left; x < mid; x++) {
-        threads::threadPool.addTask([&cam, this, &triangle, &object, x, y1, y2, d1] {
-            Triangle::drawVerticalScreenLine(cam, *this, triangle, object, x, y1, y2, d1);
+    // the nearest depth in the tile can only get nearer while this pass writes to it
+    float nearestInTile = tileMaxInverseDepth[tileIndex];
+    for (const RasterTriangle& triangle : bin.triangles) {
+        // hierarchical z: reject triangles behind everything in the tile,
+        // and skip the per-pixel depth reads for triangles in front of everything in it
+        if (triangle.maxInverseDepth < tileMinInverseDepth[tileIndex]) {
+            continue;
+        }
+        bool inFront = triangle.minInverseDepth > nearestInTile;
+        nearestInTile = std::max(nearestInTile, triangle.maxInverseDepth);
+
+        triangle.edges.rasterize(zBuffer, tileLeft, tileRight, tileBottom, tileTop, inFront, [&](int x, int y, float inverseDepth) {
+            int index = width * y + x;
+            visibilityBuffer.triangles[index] = triangle.source;
+            visibilityBuffer.objects[index] = triangle.object;
+            if (!deferredShading) {
+                Triangle::shadePixel(cam, *this, *triangle.source, x, y, inverseDepth, tileLights[tileIndex]);
+            }
         });
-        y1 += dy1;
-        y2 += dy_long;
     }
+    bin.triangles.clear();
 
-    y1 = b.screenPos.y + dy2 * (mid - b.screenPos.x);
-    y2 = a.screenPos.y + dy_long * (mid - a.screenPos.x);
-    for (float x = mid; x < right; x++) {
-        threads::threadPool.addTask([&cam, this, &triangle, &object, x, y1, y2, d1] {
-            Triangle::drawVerticalScreenLine(cam, *this, triangle, object, x, y1, y2, d1);
-        });
-        y1 += dy2;
-        y2 += dy_long;
+    // refresh the hierarchical z for this tile
+    float minInverseDepth = INFINITY;
+    float maxInverseDepth = 0;
+    for (int y = tileBottom; y <= tileTop; y++) {
+        const float* row = &zBuffer.data[width * y];
+        for (int x = tileLeft; x <= tileRight; x++) {
+            minInverseDepth = std::min(minInverseDepth, row[x]);
+            maxInverseDepth = std::max(maxInverseDepth, row[x]);
+        }
     }
+    tileMinInverseDepth[tileIndex] = minInverseDepth;
+    tileMaxInverseDepth[tileIndex] = maxInverseDepth;
 }
-void Window::drawTriangle(std::shared_ptr<Triangle> triangle, const Object3D& object, Camera& cam) {
-    Point a, b, c;
-    a = triangle->p1;
-    b = triangle->p2;
-    c = triangle->p3;
-
-    // equation for plane
-    float d1 = triangle->cameraNormal.x * a.cameraPos.x + triangle->cameraNormal.y * a.cameraPos.y + triangle->cameraNormal.z * a.cameraPos.z;
-
-    // first make a = leftmost, b = middle, c = rightmost point
-    if (a.screenPos.x > b.screenPos.x) {
-        std::swap(a, b);
+void Window::pickCenter(Camera& cam) const {
+    // reads the center pixel once rasterizeTiles() has finished, instead of checking every fragment
+    int index = width * (height / 2) + width / 2;
+    const Triangle* triangle = visibilityBuffer.triangles[index];
+    const Object3D* object = visibilityBuffer.objects[index];
+    if (triangle == nullptr) {
+        cam.lookingAtObjectId = 0;
+        return;
     }
-    if (b.screenPos.x > c.screenPos.x) {
-        std::swap(b, c);
+    cam.lookingAtObjectId = object->id;
+    cam.lookingAtNormal = triangle->absoluteNormal;
+    cam.lookingAtDepth = 1 / zBuffer.data[index];
+}
+void Window::cullLights(Camera& cam, threads::TaskGroup& tasks) {
+    // one task per tile, each culls against the depth range of what was actually drawn in its tile
+    for (int tileY = 0; tileY < numTilesY; tileY++) {
+        for (int tileX = 0; tileX < numTilesX; tileX++) {
+            tasks.addTask([this, &cam, tileX, tileY] {
+                int tileLeft = tileX * TILE_SIZE;
+                int tileRight = std::min(tileLeft + TILE_SIZE, width) - 1;
+                int tileBottom = tileY * TILE_SIZE;
+                int tileTop = std::min(tileBottom + TILE_SIZE, height) - 1;
+                float minInverseDepth = INFINITY;
+                float maxInverseDepth = 0;
+                for (int y = tileBottom; y <= tileTop; y++) {
+                    const float* row = &zBuffer.data[width * y];
+                    for (int x = tileLeft; x <= tileRight; x++) {
+                        // empty pixels are never shaded
+                        if (row[x] > 0) {
+                            minInverseDepth = std::min(minInverseDepth, row[x]);
+                            maxInverseDepth = std::max(maxInverseDepth, row[x]);
+                        }
+                    }
+                }
+                cullTileLights(cam, tileX, tileY, minInverseDepth, maxInverseDepth);
+            });
+        }
     }
-    if (a.screenPos.x > b.screenPos.x) {
-        std::swap(a, b);
+}
+void Window::cullTileLights(const Camera& cam, int tileX, int tileY, float minInverseDepth, float maxInverseDepth) {
+    std::vector<int>& lights = tileLights[tileY * numTilesX + tileX];
+    lights.clear();
+    if (!(maxInverseDepth > 0)) {
+        return;
     }
-
-    float dy_long = (c.screenPos.y - a.screenPos.y) / (c.screenPos.x - a.screenPos.x);
-    float dy1 = (b.screenPos.y - a.screenPos.y) / (b.screenPos.x - a.screenPos.x);
-    float dy2 = (c.screenPos.y - b.screenPos.y) / (c.screenPos.x - b.screenPos.x);
-
-    float left = a.screenPos.x;
-    float  mid = b.screenPos.x;
-    float right = c.screenPos.x;
-    utils::clampToRange(left, width - 1);
-    utils::clampToRange(mid, width - 1);
-    utils::clampToRange(right, width - 1);
-
-    // std::cout << left << ", " << mid << ", " << right << "\n";
-
-    float y1, y2; // y1 for shorter line segment, y2 for longer line segment
-    int bottom, top;
-    y1 = a.screenPos.y + dy1 * (left - a.screenPos.x);
-    y2 = a.screenPos.y + dy_long * (left - a.screenPos.x);
-    for (float x = left; x < mid; x++) {
-        threads::threadPool.addTask([&cam, this, triangle, &object, x, y1, y2, d1] {
-            Triangle::drawVerticalScreenLine(cam, *this, triangle, object, x, y1, y2, d1);
-        });
-        y1 += dy1;
-        y2 += dy_long;
+    // the part of the view frustum behind the tile, between the two depths.
+    // Nothing is drawn nearer than the near plane, which also keeps the corners finite
+    maxInverseDepth = std::min(maxInverseDepth, 1 / Camera::NEAR_PLANE);
+    minInverseDepth = std::min(minInverseDepth, maxInverseDepth);
+    float ndcLeft = 1 - 2 * tileX * TILE_SIZE * widthInv;
+    float ndcRight = 1 - 2 * std::min((tileX + 1) * TILE_SIZE, width) * widthInv;
+    float ndcBottom = 1 - 2 * tileY * TILE_SIZE * heightInv;
+    float ndcTop = 1 - 2 * std::min((tileY + 1) * TILE_SIZE, height) * heightInv;
+    Vec3 corners[8];
+    for (int i = 0; i < 8; i++) {
+        float world[4];
+        cam.inverseViewProjection.transform((i & 1) ? ndcRight : ndcLeft, (i & 2) ? ndcTop : ndcBottom, (i & 4) ? maxInverseDepth : minInverseDepth, 1, world);
+        corners[i] = Vec3(world[0], world[1], world[2]);
+        corners[i] *= 1 / world[3];
+    }
+    for (size_t i = 0; i < Light::lights.size(); i++) {
+        if (Light::lights[i].mayLight(corners, 8)) {
+            lights.push_back((int) i);
+        }
     }
-
-    y1 = b.screenPos.y + dy2 * (mid - b.screenPos.x);
-    y2 = a.screenPos.y + dy_long * (mid - a.screenPos.x);
-    for (float x = mid; x < right; x++) {
-        threads::threadPool.addTask([&cam, this, triangle, &object, x, y1, y2, d1] {
-            Triangle::drawVerticalScreenLine(cam, *this, triangle, object, x, y1, y2, d1);
-        });
-        y1 += dy2;
-        y2 += dy_long;
+}
+bool Window::isOccluded(float minX, float maxX, float minY, float maxY, float maxInverseDepth) const {
+    // the screen rectangle must already be clamped to the window
+    int tileLeft = (int) ceil(minX) / TILE_SIZE;
+    int tileRight = (int) floor(maxX) / TILE_SIZE;
+    int tileBottom = (int) ceil(minY) / TILE_SIZE;
+    int tileTop = (int) floor(maxY) / TILE_SIZE;
+    for (int tileY = tileBottom; tileY <= tileTop; tileY++) {
+        for (int tileX = tileLeft; tileX <= tileRight; tileX++) {
+            if (maxInverseDepth >= tileMinInverseDepth[tileY * numTilesX + tileX]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+bool Window::isOccluded(const Object3D& object, const Camera& cam) const {
+    // screen bounds and nearest depth of the 8 corners, only usable when they are all in front of the camera
+    float minX = width, maxX = -1, minY = height, maxY = -1;
+    float minDepth = INFINITY;
+    for (int i = 0; i < 8; i++) {
+        Point corner(
+            (i & 1) ? object.boundsMax.x : object.boundsMin.x,
+            (i & 2) ? object.boundsMax.y : object.boundsMin.y,
+            (i & 4) ? object.boundsMax.z : object.boundsMin.z
+        );
+        corner.calculateCameraPos(cam);
+        if (corner.cameraPos.x <= 0) {
+            return false;
+        }
+        minDepth = std::min(minDepth, corner.cameraPos.x);
+        corner.calculateProjectedPos();
+        corner.calculateScreenPos(cam, *this);
+        minX = std::min(minX, corner.screenPos.x);
+        maxX = std::max(maxX, corner.screenPos.x);
+        minY = std::min(minY, corner.screenPos.y);
+        maxY = std::max(maxY, corner.screenPos.y);
+    }
+    if (maxX < 0 || minX > width - 1 || maxY < 0 || minY > height - 1) {
+        return false;
+    }
+    utils::clampToRange(minX, width - 1);
+    utils::clampToRange(maxX, width - 1);
+    utils::clampToRange(minY, height - 1);
+    utils::clampToRange(maxY, height - 1);
+    return isOccluded(minX, maxX, minY, maxY, 1 / minDepth);
+}
+void Window::shadeVisibleTriangles(Camera& cam, threads::TaskGroup& tasks) {
+    if (!deferredShading) {
+        return;
+    }
+    threads::parallelFor(tasks, 0, height, SHADE_BATCH_SIZE, [this, &cam](int start, int end) {
+        for (int y = start; y < end; y++) {
+            shadeRow(cam, y);
+        }
+    });
+}
+void Window::shadeRow(Camera& cam, int y) {
+    // every pixel is written here, so the back buffer doesn't need to be cleared in deferred mode
+    uint32_t black = PixelArray::packColor(0, 0, 0);
+    for (int x = 0, index = width * y; x < width; x++, index++) {
+        const Triangle* triangle = visibilityBuffer.triangles[index];
+        if (triangle == nullptr) {
+            pixelArray.data[index] = black;
+        } else {
+            Triangle::shadePixel(cam, *this, *triangle, x, y, zBuffer.data[index], tileLights[(y / TILE_SIZE) * numTilesX + x / TILE_SIZE]);
+        }
     }
 }
-void Window::clear() {
-    pixelArray.clear();
-    zBuffer.clear();
+void Window::clear(threads::TaskGroup& tasks) {
+    // the visibility buffer is also needed for picking when not shading deferred
+    visibilityBuffer.clear(tasks);
+    if (!deferredShading) {
+        pixelArray.clear(tasks);
+    }
+    zBuffer.clear(tasks);
+    std::fill(tileMinInverseDepth.begin(), tileMinInverseDepth.end(), ZBuffer::CLEAR_INVERSE_DEPTH);
+    std::fill(tileMaxInverseDepth.begin(), tileMaxInverseDepth.end(), ZBuffer::CLEAR_INVERSE_DEPTH);
+}
+size_t Window::getMemoryUsage() const {
+    size_t total = pixelArray.getMemoryUsage() + frontPixelArray.getMemoryUsage() + zBuffer.getMemoryUsage() + visibilityBuffer.getMemoryUsage();
+    total += tileBins.capacity() * sizeof(TileBin);
+    for (const TileBin& bin : tileBins) {
+        total += bin.triangles.capacity() * sizeof(RasterTriangle);
+    }
+    total += tileLights.capacity() * sizeof(std::vector<int>);
+    for (const std::vector<int>& lights : tileLights) {
+        total += lights.capacity() * sizeof(int);
+    }
+    total += (tileMinInverseDepth.capacity() + tileMaxInverseDepth.capacity()) * sizeof(float);
+    return total;
 }
 void Window::draw() {
     // TODO: WARNING - this is implemntation specific
@@ -999,17 +1968,11 @@ void Window::draw() {
     auto spriteTime = std::chrono::duration_cast<std::chrono::microseconds>(t3 - t2);
     // std::cout << "inside graphics - pixel time: " << pixelTime.count() << ", sprite time: " << spriteTime.count() << "\n";
 }
-void Window::getUint8Pointer(uint8_t* buffer) {
-    for (int i = 0; i < pixelArray.data.size(); i += width) {
-        threads::threadPool.addTask([i, this, buffer] {
-            for (int j = i, k = 4 * i; j < i + width; j++, k += 4) {
-                buffer[k] = pixelArray.data[j].r;
-                buffer[k + 1] = pixelArray.data[j].g;
-                buffer[k + 2] = pixelArray.data[j].b;
-                buffer[k + 3] = 255;
-            }
-        });
-    }
+uint8_t* Window::swapBuffers() {
+    // pixels are already packed as RGBA8, so the finished frame is exported without a copy.
+    // Swapping the vectors only exchanges their heap pointers.
+    std::swap(pixelArray.data, frontPixelArray.data);
+    return reinterpret_cast<uint8_t*>(frontPixelArray.data.data());
 }
 
 
@@ -1018,103 +1981,50 @@ void Window::getUint8Pointer(uint8_t* buffer) {
 std::vector<Light> Light::lights;
 
 // CONSTRUCTORS
-Light::Light(Vec3 pos, float thetaZ, float thetaY, float fov, float luminosity) : zBuffer(4000, 4000), cam(pos, thetaZ, thetaY, fov) {
+Light::Light(Vec3 pos, float thetaZ, float thetaY, float fov, float luminosity, int shadowMapSize, ZBuffer::Format shadowMapFormat, float shadowMapNearDistance)
+ : zBuffer(shadowMapSize, shadowMapSize, shadowMapFormat, 1 / shadowMapNearDistance), cam(pos, thetaZ, thetaY, fov) {
     this->luminosity = luminosity;
+    filtering = PCF;
     filteringRadius = 2;
     filteringAreaInv = 1.0 / ( (2 * filteringRadius + 1) * (2 * filteringRadius + 1));
 }
+Light::Light(Vec3 pos, float thetaZ, float thetaY, float fov, float luminosity) : Light::Light(pos, thetaZ, thetaY, fov, luminosity, DEFAULT_SHADOW_MAP_SIZE, ZBuffer::FLOAT32, Camera::NEAR_PLANE) {
+}
 Light::Light(Vec3 pos, float thetaZ, float thetaY, float luminosity) : Light::Light(pos, thetaZ, thetaY, atan(0.5) * 180 / M_PI, luminosity) {
 }
 
 // METHODS
-void Light::getTrianglePerspectiveFromLight(Triangle triangle) {
-    Vec3 toCam = cam.pos - triangle.p1.absolutePos;
+int Light::getTrianglePerspectiveFromLight(const Triangle& triangle, const std::vector<Point>& vertices, EdgeRasterizer* edges) const {
+    // sets up the edges of the (at most 2) triangles left after near plane clipping, returns how many there are
+    const Point& p1 = vertices[triangle.v1];
+    const Point& p2 = vertices[triangle.v2];
+    const Point& p3 = vertices[triangle.v3];
+    Vec3 toCam = cam.pos - p1.absolutePos;
     if (triangle.absoluteNormal.dot(toCam) > 0) {
-        return;
+        return 0;
     }
-    triangle.p1.calculateCameraPos(cam);
-    triangle.p2.calculateCameraPos(cam);
-    triangle.p3.calculateCameraPos(cam);
-
-    triangle.cameraNormal = (triangle.p2.cameraPos - triangle.p1.cameraPos).cross(triangle.p3.cameraPos - triangle.p1.cameraPos);
-    triangle.cameraNormal.normalize();
 
-    triangle.p1.calculateProjectedPos();
-    triangle.p2.calculateProjectedPos();
-    triangle.p3.calculateProjectedPos();
-
-    std::array<Point*, 3> front;
-    int frontSize = 0;
-    std::array<Point*, 3> behind;
-    int behindSize = 0;
-
-    if (triangle.p1.projectedPos.z > 0) {
-        front[frontSize] = &triangle.p1;
-        ++frontSize;
-    } else {
-        behind[behindSize] = &triangle.p1;
-        ++behindSize;
-    }
-    if (triangle.p2.projectedPos.z > 0) {
-        front[frontSize] = &triangle.p2;
-        ++frontSize;
-    } else {
-        behind[behindSize] = &triangle.p2;
-        ++behindSize;
-    }
-    if (triangle.p3.projectedPos.z > 0) {
-        front[frontSize] = &triangle.p3;
-        ++frontSize;
-    } else {
-        behind[behindSize] = &triangle.p3;
-        ++behindSize;
+    // nothing to clip, the vertices were already projected
+    if (p1.cameraPos.x >= Camera::NEAR_PLANE && p2.cameraPos.x >= Camera::NEAR_PLANE && p3.cameraPos.x >= Camera::NEAR_PLANE) {
+        return setupTriangleEdges(p1, p2, p3, edges[0]) ? 1 : 0;
     }
 
-    if (frontSize == 0) {
-        return;
-    } else if (frontSize == 1) {
-        behind[0]->projectedPos += 100 * (front[0]->projectedPos - behind[0]->projectedPos);
-        behind[0]->projectedPos.z = 1;
-        behind[1]->projectedPos += 100 * (front[0]->projectedPos - behind[1]->projectedPos);
-        behind[1]->projectedPos.z = 1;
-
-        front[0]->calculateScreenPos(cam, zBuffer.width, zBuffer.height);
-        behind[0]->calculateScreenPos(cam, zBuffer.width, zBuffer.height);
-        behind[1]->calculateScreenPos(cam, zBuffer.width, zBuffer.height);
-
-        addTriangleToZBuffer(triangle);
-    } else if (frontSize == 2) {
-        front[0]->calculateScreenPos(cam, zBuffer.width, zBuffer.height);
-        front[1]->calculateScreenPos(cam, zBuffer.width, zBuffer.height);
-
-        Point behind2 = *behind[0];
-        behind[0]->projectedPos += 100 * (front[0]->projectedPos - behind[0]->projectedPos);
-        behind2.projectedPos += 100 * (front[1]->projectedPos - behind2.projectedPos);
-
-        behind[0]->calculateScreenPos(cam, zBuffer.width, zBuffer.height);
-        behind2.calculateScreenPos(cam, zBuffer.width, zBuffer.height);
-
-        // needed to preserve the 3 original cameraPos values to be used in plane-calculation for depth buffer
-        behind2.cameraPos = front[0]->cameraPos;
-
-        Triangle t(*front[1], *behind[0], behind2);
-
-        addTriangleToZBuffer(triangle);
-        addTriangleToZBuffer(t);
-    } else {
-        front[0]->calculateScreenPos(cam, zBuffer.width, zBuffer.height);
-        front[1]->calculateScreenPos(cam, zBuffer.width, zBuffer.height);
-        front[2]->calculateScreenPos(cam, zBuffer.width, zBuffer.height);
-
-        addTriangleToZBuffer(triangle);
+    // clip against the near plane, the result is drawn as a triangle fan
+    std::array<Point, 4> clipped;
+    int clippedSize = Triangle::clipToNearPlane(p1, p2, p3, clipped);
+    for (int i = 0; i < clippedSize; i++) {
+        clipped[i].calculateProjectedPos();
+        clipped[i].calculateScreenPos(cam, zBuffer.width, zBuffer.height);
+    }
+    int numEdges = 0;
+    for (int i = 1; i + 1 < clippedSize; i++) {
+        if (setupTriangleEdges(clipped[0], clipped[i], clipped[i + 1], edges[numEdges])) {
+            numEdges++;
+        }
     }
+    return numEdges;
 }
-void Light::addTriangleToZBuffer(Triangle &triangle) {
-    Point a, b, c;
-    a = triangle.p1;
-    b = triangle.p2;
-    c = triangle.p3;
-
+bool Light::setupTriangleEdges(const Point& a, const Point& b, const Point& c, EdgeRasterizer& edges) const {
     // equation for plane
     Vec3 normal = (a.cameraPos - b.cameraPos).cross(a.cameraPos - c.cameraPos);
     normal.normalize();
@@ -1125,118 +2035,581 @@ void Light::addTriangleToZBuffer(Triangle &triangle) {
     }
 
     float d1 = normal.x * a.cameraPos.x + normal.y * a.cameraPos.y + normal.z * a.cameraPos.z;
-
-    // first make a = leftmost, b = middle, c = rightmost point
-    if (a.screenPos.x > b.screenPos.x) {
-        std::swap(a, b);
-    }
-    if (b.screenPos.x > c.screenPos.x) {
-        std::swap(b, c);
+    return edges.setup(a.screenPos, b.screenPos, c.screenPos, normal, d1, cam, zBuffer.width, zBuffer.height);
+}
+void Light::fillZBuffer(const Object3D& object) {
+    fillZBuffer(object, 0, zBuffer.width - 1, 0, zBuffer.height - 1);
+}
+void Light::fillZBuffer(const Object3D& object, int left, int right, int bottom, int top) {
+    if (filtering == RAYTRACED) {
+        return;
     }
-    if (a.screenPos.x > b.screenPos.x) {
-        std::swap(a, b);
+    ShadowRegion drawn = rasterizeObject(object, left, right, bottom, top);
+    if (drawn.left <= drawn.right && drawn.bottom <= drawn.top) {
+        updateMoments(drawn.left, drawn.right, drawn.bottom, drawn.top);
     }
+}
+Light::ShadowRegion Light::rasterizeObject(const Object3D& object, int left, int right, int bottom, int top) {
+    // only pixels inside the rectangle are written, the region stored for the object always covers all of it
+    threads::TaskGroup tasks;
+
+    // objects outside the light's frustum can't reach the shadow map, they are recorded with an empty region
+    bool inFrustum = object.isInFrustum(cam, (float) zBuffer.height / zBuffer.width);
 
-    float dy_long = (c.screenPos.y - a.screenPos.y) / (c.screenPos.x - a.screenPos.x);
-    float dy1 = (b.screenPos.y - a.screenPos.y) / (b.screenPos.x - a.screenPos.x);
-    float dy2 = (c.screenPos.y - b.screenPos.y) / (c.screenPos.x - b.screenPos.x);
-
-    float left = a.screenPos.x;
-    float  mid = b.screenPos.x;
-    float right = c.screenPos.x;
-    utils::clampToRange(left, zBuffer.width - 1);
-    utils::clampToRange(mid, zBuffer.width - 1);
-    utils::clampToRange(right, zBuffer.width - 1);
-
-    // std::cout << left << ", " << mid << ", " << right << "\n";
-
-    float y1, y2; // y1 for shorter line segment, y2 for longer line segment
-    int bottom, top;
-    y1 = a.screenPos.y + dy1 * (left - a.screenPos.x);
-    y2 = a.screenPos.y + dy_long * (left - a.screenPos.x);
-    for (float x = left; x < mid; x++) {
-        bottom = round(y1);
-        top = round(y2);
-        utils::sortAndClamp(bottom, top, zBuffer.height - 1);
-        float cameraY = cam.getCameraYFromPixel(x, zBuffer.width);
-        float depth;
-        for (int y = bottom; y <= top; y++) {
-            // calculate depth
-            float cameraZ = cam.getCameraZFromPixel(y, zBuffer.height);
-            float cameraX = 1;
-            depth = (d1 / (normal.x * cameraX + normal.y * cameraY + normal.z * cameraZ)) * sqrt(cameraX * cameraX + cameraY * cameraY + cameraZ * cameraZ);
-            if (depth < 0) {
-                if (depth < -0.1) {
-                    // std::cout << "ERROR: depth < -0.1, depth = " << depth << std::endl;
+    // the vertices are transformed into a copy, the cache in object belongs to the camera
+    std::vector<Point> vertices;
+    if (inFrustum) {
+        vertices = object.vertices;
+        threads::parallelFor(tasks, 0, vertices.size(), Object3D::VERTEX_BATCH_SIZE, [this, &vertices](int start, int end) {
+            cam.transformPoints(&vertices[start], end - start, zBuffer.width, zBuffer.height);
+        });
+        tasks.wait();
+    }
+
+    // every chunk of BIN_BATCH_SIZE triangles sets up its triangles, bounds the pixels they cover and sorts them into
+    // the tiles of the shadow map their bounding boxes touch within the rectangle, in order, so a tile only visits
+    // its own. Triangles with every corner in front of the near plane and outside the rectangle are skipped before
+    // they are set up, which is most of an object when only a small part of the map is redrawn
+    struct ChunkBins {
+        ShadowRegion region;
+        std::vector<EdgeRasterizer> edges; // near plane clipping can turn a triangle into 2
+        std::vector<std::vector<int> > tileTriangles; // indices into edges
+    };
+    int numTriangles = inFrustum ? object.triangles.size() : 0;
+    int numChunks = (numTriangles + BIN_BATCH_SIZE - 1) / BIN_BATCH_SIZE;
+    std::vector<ChunkBins> chunks(numChunks);
+    ShadowRegion requested = {object.id, left, right, bottom, top};
+    threads::parallelFor(tasks, 0, numChunks, 1, [this, &object, &vertices, &chunks, &requested](int start, int end) {
+        int numTilesX = (zBuffer.width + TILE_SIZE - 1) / TILE_SIZE;
+        int numTilesY = (zBuffer.height + TILE_SIZE - 1) / TILE_SIZE;
+        for (int chunk = start; chunk < end; chunk++) {
+            ShadowRegion& region = chunks[chunk].region;
+            region = {requested.objectId, zBuffer.width, -1, zBuffer.height, -1};
+            std::vector<EdgeRasterizer>& edges = chunks[chunk].edges;
+            std::vector<std::vector<int> >& tileTriangles = chunks[chunk].tileTriangles;
+            tileTriangles.resize(numTilesX * numTilesY);
+            int chunkEnd = std::min((chunk + 1) * BIN_BATCH_SIZE, (int) object.triangles.size());
+            for (int i = chunk * BIN_BATCH_SIZE; i < chunkEnd; i++) {
+                const Triangle& source = object.triangles[i];
+                const Point& p1 = vertices[source.v1];
+                const Point& p2 = vertices[source.v2];
+                const Point& p3 = vertices[source.v3];
+                // a pixel of margin covers the snapping of the corners
+                if (p1.cameraPos.x >= Camera::NEAR_PLANE && p2.cameraPos.x >= Camera::NEAR_PLANE && p3.cameraPos.x >= Camera::NEAR_PLANE) {
+                    if (std::max({p1.screenPos.x, p2.screenPos.x, p3.screenPos.x}) < requested.left - 1 ||
+                        std::min({p1.screenPos.x, p2.screenPos.x, p3.screenPos.x}) > requested.right + 1 ||
+                        std::max({p1.screenPos.y, p2.screenPos.y, p3.screenPos.y}) < requested.bottom - 1 ||
+                        std::min({p1.screenPos.y, p2.screenPos.y, p3.screenPos.y}) > requested.top + 1) {
+                        continue;
+                    }
+                }
+                EdgeRasterizer setUp[2];
+                int numSetUp = getTrianglePerspectiveFromLight(source, vertices, setUp);
+                for (int j = 0; j < numSetUp; j++) {
+                    const EdgeRasterizer& triangle = setUp[j];
+                    int triangleLeft = std::max(std::ceil(triangle.minX), 0.0f);
+                    int triangleRight = std::min(std::floor(triangle.maxX), zBuffer.width - 1.0f);
+                    int triangleBottom = std::max(std::ceil(triangle.minY), 0.0f);
+                    int triangleTop = std::min(std::floor(triangle.maxY), zBuffer.height - 1.0f);
+                    if (triangleLeft > triangleRight || triangleBottom > triangleTop) {
+                        continue;
+                    }
+                    region.left = std::min(region.left, triangleLeft);
+                    region.right = std::max(region.right, triangleRight);
+                    region.bottom = std::min(region.bottom, triangleBottom);
+                    region.top = std::max(region.top, triangleTop);
+
+                    triangleLeft = std::max(triangleLeft, requested.left);
+                    triangleRight = std::min(triangleRight, requested.right);
+                    triangleBottom = std::max(triangleBottom, requested.bottom);
+                    triangleTop = std::min(triangleTop, requested.top);
+                    if (triangleLeft > triangleRight || triangleBottom > triangleTop) {
+                        continue;
+                    }
+                    edges.push_back(triangle);
+                    for (int tileY = triangleBottom / TILE_SIZE; tileY <= triangleTop / TILE_SIZE; tileY++) {
+                        for (int tileX = triangleLeft / TILE_SIZE; tileX <= triangleRight / TILE_SIZE; tileX++) {
+                            tileTriangles[tileY * numTilesX + tileX].push_back(edges.size() - 1);
+                        }
+                    }
                 }
-                depth = 0;
-            }
-            if (depth < zBuffer.getDepth(x, y)) {
-                float depthBias = std::max(0.05 * (1 - abs(normal.x)), 0.001);
-                depthBias = 0;
-                zBuffer.setDepth(x, y, depth + depthBias);
             }
         }
-        y1 += dy1;
-        y2 += dy_long;
-    }
-
-    y1 = b.screenPos.y + dy2 * (mid - b.screenPos.x);
-    y2 = a.screenPos.y + dy_long * (mid - a.screenPos.x);
-    for (float x = mid; x < right; x++) {
-        bottom = round(y1);
-        top = round(y2);
-        utils::sortAndClamp(bottom, top, zBuffer.height - 1);
-        float cameraY = cam.getCameraYFromPixel(x, zBuffer.width);
-        float depth;
-        for (int y = bottom; y <= top; y++) {
-            // calculate depth
-            float cameraZ = cam.getCameraZFromPixel(y, zBuffer.height);
-            float cameraX = 1;
-            depth = (d1 / (normal.x * cameraX + normal.y * cameraY + normal.z * cameraZ)) * sqrt(cameraX * cameraX + cameraY * cameraY + cameraZ * cameraZ);
-            if (depth < 0) {
-                depth = 0;
+    });
+    tasks.wait();
+
+    // remember where the object is in the shadow map, so removing it only has to redo that part.
+    // Skipped triangles are missing from the chunks' bounds, so a recorded region is only ever extended
+    ShadowRegion region = {object.id, zBuffer.width, -1, zBuffer.height, -1};
+    for (const ChunkBins& chunk : chunks) {
+        region.left = std::min(region.left, chunk.region.left);
+        region.right = std::max(region.right, chunk.region.right);
+        region.bottom = std::min(region.bottom, chunk.region.bottom);
+        region.top = std::max(region.top, chunk.region.top);
+    }
+    auto existing = std::find_if(objectRegions.begin(), objectRegions.end(), [&object](const ShadowRegion& r) {
+        return r.objectId == object.id;
+    });
+    if (existing != objectRegions.end()) {
+        existing->left = region.left = std::min(existing->left, region.left);
+        existing->right = region.right = std::max(existing->right, region.right);
+        existing->bottom = region.bottom = std::min(existing->bottom, region.bottom);
+        existing->top = region.top = std::max(existing->top, region.top);
+    } else {
+        objectRegions.push_back(region);
+    }
+
+    // one task per tile, so every pixel of the shadow map is only ever touched by a single thread.
+    // A tile draws the chunks in order, which keeps the triangles in the order of the object
+    left = std::max(left, region.left);
+    right = std::min(right, region.right);
+    bottom = std::max(bottom, region.bottom);
+    top = std::min(top, region.top);
+    ShadowRegion rect = {object.id, left, right, bottom, top};
+    if (left > right || bottom > top) {
+        return rect;
+    }
+    int numTilesX = right / TILE_SIZE - left / TILE_SIZE + 1;
+    int numTilesY = top / TILE_SIZE - bottom / TILE_SIZE + 1;
+    threads::parallelFor(tasks, 0, numTilesX * numTilesY, 1, [this, &rect, &chunks, numTilesX](int start, int end) {
+        int numMapTilesX = (zBuffer.width + TILE_SIZE - 1) / TILE_SIZE;
+        for (int tile = start; tile < end; tile++) {
+            int tileX = rect.left / TILE_SIZE + tile % numTilesX;
+            int tileY = rect.bottom / TILE_SIZE + tile / numTilesX;
+            int rectLeft = std::max(rect.left, tileX * TILE_SIZE);
+            int rectRight = std::min(rect.right, tileX * TILE_SIZE + TILE_SIZE - 1);
+            int rectBottom = std::max(rect.bottom, tileY * TILE_SIZE);
+            int rectTop = std::min(rect.top, tileY * TILE_SIZE + TILE_SIZE - 1);
+            for (const ChunkBins& chunk : chunks) {
+                for (int i : chunk.tileTriangles[tileY * numMapTilesX + tileX]) {
+                    chunk.edges[i].rasterize(zBuffer, rectLeft, rectRight, rectBottom, rectTop, false, [](int, int, float) {});
+                }
             }
-            if (depth < zBuffer.getDepth(x, y)) {
-                float depthBias = std::max(0.05 * (1 - abs(normal.x)), 0.001);
-                depthBias = 0;
-                zBuffer.setDepth(x, y, depth + depthBias);
+        }
+    });
+    tasks.wait();
+    return rect;
+}
+void Light::removeFromZBuffer(int objectId, const std::vector<Object3D>& remainingObjects) {
+    // clears the pixels the object was drawn into, then redraws only the objects overlapping them.
+    // Nothing is recorded while filtering is RAYTRACED
+    auto removed = std::find_if(objectRegions.begin(), objectRegions.end(), [objectId](const ShadowRegion& r) {
+        return r.objectId == objectId;
+    });
+    if (removed == objectRegions.end()) {
+        return;
+    }
+    ShadowRegion region = *removed;
+    objectRegions.erase(removed);
+    if (region.left > region.right || region.bottom > region.top) {
+        return;
+    }
+
+    threads::TaskGroup tasks;
+    zBuffer.clear(tasks, region.left, region.right, region.bottom, region.top);
+    tasks.wait();
+
+    for (const ShadowRegion& other : objectRegions) {
+        if (other.right < region.left || other.left > region.right || other.top < region.bottom || other.bottom > region.top) {
+            continue;
+        }
+        for (const Object3D& object : remainingObjects) {
+            if (object.id == other.objectId) {
+                rasterizeObject(object, region.left, region.right, region.bottom, region.top);
+                break;
             }
         }
-        y1 += dy2;
-        y2 += dy_long;
     }
-}
-void Light::fillZBuffer(std::vector<Triangle> &triangles) {
-    for (Triangle &triangle : triangles) {
-        getTrianglePerspectiveFromLight(triangle);
+    updateMoments(region.left, region.right, region.bottom, region.top);
+}
+void Light::setFiltering(Filtering filtering, const std::vector<Object3D>& objects) {
+    bool hadShadowMap = this->filtering != RAYTRACED;
+    this->filtering = filtering;
+    if (filtering == RAYTRACED) {
+        // nothing reads the shadow map anymore, so it is given back instead of kept up to date
+        std::vector<float>().swap(zBuffer.data);
+        std::vector<uint16_t>().swap(zBuffer.data16);
+        std::vector<ShadowRegion>().swap(objectRegions);
+        std::vector<float>().swap(moments);
+        std::vector<uint16_t>().swap(moments16);
+        return;
+    }
+
+    std::vector<float>().swap(moments);
+    std::vector<uint16_t>().swap(moments16);
+    if (filtering == VARIANCE) {
+        if (zBuffer.format == ZBuffer::FLOAT32) {
+            moments = std::vector<float>(2 * zBuffer.width * zBuffer.height, 0);
+        } else {
+            moments16 = std::vector<uint16_t>(2 * zBuffer.width * zBuffer.height, 0);
+        }
     }
+    if (!hadShadowMap) {
+        zBuffer = ZBuffer(zBuffer.width, zBuffer.height, zBuffer.format, zBuffer.maxInverseDepth);
+        for (const Object3D& object : objects) {
+            rasterizeObject(object, 0, zBuffer.width - 1, 0, zBuffer.height - 1);
+        }
+    }
+    updateMoments(0, zBuffer.width - 1, 0, zBuffer.height - 1);
 }
-float Light::amountLit(Vec3 &vec, float& vecToLightMagInv) {
-    Point p(vec);
-    p.calculateCameraPos(cam);
-    p.calculateProjectedPos();
-    p.calculateScreenPos(cam, zBuffer.width, zBuffer.height);
-    int x = round(p.screenPos.x);
-    int y = round(p.screenPos.y);
+void Light::updateMoments(int left, int right, int bottom, int top) {
+    if (filtering != VARIANCE) {
+        return;
+    }
+    // box filter over the same area PCF uses, pixels past the edges repeat the edge.
+    // Every moment within filteringRadius of the rectangle depends on it
+    int radius = filteringRadius;
+    left = std::max(left - radius, 0);
+    right = std::min(right + radius, zBuffer.width - 1);
+    bottom = std::max(bottom - radius, 0);
+    top = std::min(top + radius, zBuffer.height - 1);
+    ShadowRegion rect = {0, left, right, bottom, top};
+
+    // horizontal pass into a copy covering the rows the vertical pass reads
+    int rowsBottom = std::max(bottom - radius, 0);
+    int rowsTop = std::min(top + radius, zBuffer.height - 1);
+    int rectWidth = right - left + 1;
+    std::vector<float> horizontal(2 * rectWidth * (rowsTop - rowsBottom + 1));
+    threads::TaskGroup tasks;
+    threads::parallelFor(tasks, rowsBottom, rowsTop + 1, MOMENTS_BATCH_SIZE, [this, &rect, &horizontal, rowsBottom, rectWidth](int start, int end) {
+        int radius = filteringRadius;
+        for (int y = start; y < end; y++) {
+            int rowStart = zBuffer.width * y;
+            float* out = &horizontal[2 * rectWidth * (y - rowsBottom)];
+            for (int x = rect.left; x <= rect.right; x++, out += 2) {
+                float sum = 0, sumSquares = 0;
+                for (int i = x - radius; i <= x + radius; i++) {
+                    int index = rowStart + std::max(0, std::min(i, zBuffer.width - 1));
+                    float inverseDepth = zBuffer.format == ZBuffer::FLOAT32 ? zBuffer.data[index] : zBuffer.decodeUnorm16(zBuffer.data16[index]);
+                    sum += inverseDepth;
+                    sumSquares += inverseDepth * inverseDepth;
+                }
+                out[0] = sum;
+                out[1] = sumSquares;
+            }
+        }
+    });
+    tasks.wait();
+
+    // vertical pass straight into moments
+    threads::parallelFor(tasks, bottom, top + 1, MOMENTS_BATCH_SIZE, [this, &rect, &horizontal, rowsBottom, rectWidth](int start, int end) {
+        int radius = filteringRadius;
+        float toUnorm16 = 65535 / zBuffer.maxInverseDepth;
+        for (int y = start; y < end; y++) {
+            int index = 2 * (zBuffer.width * y + rect.left);
+            for (int x = 0; x < rectWidth; x++, index += 2) {
+                float sum = 0, sumSquares = 0;
+                for (int j = y - radius; j <= y + radius; j++) {
+                    int row = std::max(0, std::min(j, zBuffer.height - 1)) - rowsBottom;
+                    const float* in = &horizontal[2 * (rectWidth * row + x)];
+                    sum += in[0];
+                    sumSquares += in[1];
+                }
+                float mean = sum * filteringAreaInv;
+                float deviation = std::sqrt(std::max(sumSquares * filteringAreaInv - mean * mean, 0.0f));
+                if (zBuffer.format == ZBuffer::FLOAT32) {
+                    moments[index] = mean;
+                    moments[index + 1] = deviation;
+                } else {
+                    moments16[index] = zBuffer.encodeUnorm16(mean);
+                    moments16[index + 1] = (uint16_t) std::min(std::ceil(deviation * toUnorm16), 65535.0f);
+                }
+            }
+        }
+    });
+    tasks.wait();
+}
+float Light::amountLit(Vec3 &vec, const Vec3& normal, float& vecToLightMagInv) {
+    float clip[4];
+    cam.viewProjection.transform(vec.x, vec.y, vec.z, 1, clip);
+    if (filtering == RAYTRACED) {
+        // the same cone the shadow map covers, then a single ray. It starts off the surface along the normal,
+        // the point is rebuilt from the depth buffer and may be slightly behind the triangle it is on
+        float aspect = (float) zBuffer.height / zBuffer.width;
+        if (clip[3] <= 0 || std::fabs(clip[0]) > clip[3] || std::fabs(clip[1]) > clip[3] * aspect) {
+            return 0;
+        }
+        Vec3 origin = vec + normal * SHADOW_RAY_OFFSET;
+        Vec3 toLight = cam.pos - origin;
+        float distance = toLight.mag();
+        toLight *= 1 / distance;
+        if (Object3D::isOccluded(origin, toLight, distance)) {
+            return 0;
+        }
+        return std::min(luminosity * vecToLightMagInv * vecToLightMagInv, 1.0f);
+    }
+    float wInv = 1 / clip[3];
+    // same mapping as Point::calculateScreenPos
+    int x = round((0.5 * zBuffer.width) * (1 - clip[0] * wInv) - 0.5);
+    int y = round(0.5 * (zBuffer.height - clip[1] * wInv * zBuffer.width) - 0.5);
+    float inverseDepth = clip[2] * wInv;
     float lightingLevel = 0;
-    int offset = 2;
-    for (int i = x - offset; i <= x + offset; i++) {
-        for (int j = y - offset; j <= y + offset; j++) {
-            if (i < 0 || i >= zBuffer.width || j < 0 || j >= zBuffer.height) {
-                continue;
+    if (filtering == VARIANCE) {
+        if (x >= 0 && x < zBuffer.width && y >= 0 && y < zBuffer.height) {
+            int index = 2 * (zBuffer.width * y + x);
+            bool isFloat = zBuffer.format == ZBuffer::FLOAT32;
+            float mean = isFloat ? moments[index] : zBuffer.decodeUnorm16(moments16[index]);
+            if (inverseDepth >= mean) {
+                lightingLevel = 1;
+            } else {
+                // Chebyshev's inequality bounds the fraction of the area that is nearer than the point
+                float deviation = isFloat ? moments[index + 1] : zBuffer.decodeUnorm16(moments16[index + 1]);
+                float variance = std::max(deviation * deviation, MIN_RELATIVE_VARIANCE * mean * mean);
+                float difference = inverseDepth - mean;
+                lightingLevel = variance / (variance + difference * difference);
             }
-            if (p.distToCamera <= zBuffer.getDepth(i, j)) {
-                lightingLevel += 1;
+        }
+    } else {
+        int offset = filteringRadius;
+        for (int i = x - offset; i <= x + offset; i++) {
+            for (int j = y - offset; j <= y + offset; j++) {
+                if (i < 0 || i >= zBuffer.width || j < 0 || j >= zBuffer.height) {
+                    continue;
+                }
+                if (inverseDepth >= zBuffer.getInverseDepth(i, j)) {
+                    lightingLevel += 1;
+                }
             }
         }
+        lightingLevel *= filteringAreaInv;
     }
-    lightingLevel *= filteringAreaInv;
     lightingLevel *= luminosity;
     lightingLevel *= vecToLightMagInv * vecToLightMagInv;
     lightingLevel = std::min(lightingLevel, 1.0f);
     return lightingLevel;
 }
+bool Light::mayLight(const Vec3* corners, int numCorners) const {
+    // out of range when even the nearest point of the corners' bounding box is too far to get MIN_INTENSITY
+    Vec3 nearest = cam.pos;
+    for (int axis = 0; axis < 3; axis++) {
+        float low = INFINITY, high = -INFINITY;
+        for (int i = 0; i < numCorners; i++) {
+            float value = axis == 0 ? corners[i].x : axis == 1 ? corners[i].y : corners[i].z;
+            low = std::min(low, value);
+            high = std::max(high, value);
+        }
+        float& coordinate = axis == 0 ? nearest.x : axis == 1 ? nearest.y : nearest.z;
+        utils::clampToRange(coordinate, low, high);
+    }
+    Vec3 toNearest = nearest - cam.pos;
+    if (toNearest.dot(toNearest) * MIN_INTENSITY > luminosity) {
+        return false;
+    }
+
+    // outside the shadow frustum when every corner is on the wrong side of the same plane, the planes are
+    // linear in clip space so the whole hull is too. The sides are widened by the pixels filtering reads past them
+    float margin = filtering == RAYTRACED ? 1 : 1 + 2.0f * (filteringRadius + 1) / zBuffer.width;
+    float aspect = (float) zBuffer.height / zBuffer.width;
+    int outside[5] = {0, 0, 0, 0, 0};
+    for (int i = 0; i < numCorners; i++) {
+        float clip[4];
+        cam.viewProjection.transform(corners[i].x, corners[i].y, corners[i].z, 1, clip);
+        float w = clip[3] * margin;
+        outside[0] += clip[3] <= 0;
+        outside[1] += clip[0] > w;
+        outside[2] += clip[0] < -w;
+        outside[3] += clip[1] > w * aspect;
+        outside[4] += clip[1] < -w * aspect;
+    }
+    for (int plane = 0; plane < 5; plane++) {
+        if (outside[plane] == numCorners) {
+            return false;
+        }
+    }
+    return true;
+}
+size_t Light::getMemoryUsage() const {
+    return zBuffer.getMemoryUsage() + objectRegions.capacity() * sizeof(ShadowRegion) + moments.capacity() * sizeof(float)
+        + moments16.capacity() * sizeof(uint16_t);
+}
+
+// STATIC METHODS
+size_t Light::getTotalMemoryUsage() {
+    size_t total = 0;
+    for (const Light& light : lights) {
+        total += light.getMemoryUsage();
+    }
+    return total;
+}
+
+
+//-----------------------------------------------------------------------------------
+// IMPLEMENTATION OF "RayTracer"
+
+static uint32_t hashSeed(uint32_t seed) {
+    // integer hash, so neighbouring pixels and samples don't start with similar states. Never returns 0, where xorshift gets stuck
+    seed ^= seed >> 16;
+    seed *= 0x7FEB352Du;
+    seed ^= seed >> 15;
+    seed *= 0x846CA68Bu;
+    seed ^= seed >> 16;
+    return seed != 0 ? seed : 1;
+}
+
+// CONSTRUCTOR
+RayTracer::RayTracer(int width, int height) {
+    this->width = width;
+    this->height = height;
+    this->numSamples = 0;
+}
+
+// METHODS
+void RayTracer::reset() {
+    // the first sample overwrites the accumulation instead of adding to it, so nothing needs clearing
+    numSamples = 0;
+}
+void RayTracer::render(const Camera& cam, Window& window, threads::TaskGroup& tasks) {
+    if (window.width != width || window.height != height) {
+        std::cout << "RayTracer::render() failed, window size doesn't match. INPUTS: window.width = " << window.width <<
+        ", window.height = " << window.height << std::endl;
+        throw "window size doesn't match";
+    }
+    if (accumulation.empty()) {
+        accumulation = std::vector<float>(3 * width * height, 0);
+    }
+    if (std::memcmp(cam.viewProjection.m, sampledViewProjection.m, sizeof(cam.viewProjection.m)) != 0) {
+        sampledViewProjection = cam.viewProjection;
+        reset();
+    }
+
+    // one task per tile, every pixel belongs to exactly one of them
+    int sample = numSamples++;
+    int numTilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    int numTilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+    threads::parallelFor(tasks, 0, numTilesX * numTilesY, 1, [this, &cam, &window, sample, numTilesX](int start, int end) {
+        for (int tile = start; tile < end; tile++) {
+            traceTile(cam, window, tile % numTilesX, tile / numTilesX, sample);
+        }
+    });
+}
+void RayTracer::traceTile(const Camera& cam, Window& window, int tileX, int tileY, int sample) {
+    int tileLeft = tileX * TILE_SIZE;
+    int tileRight = std::min(tileLeft + TILE_SIZE, width);
+    int tileBottom = tileY * TILE_SIZE;
+    int tileTop = std::min(tileBottom + TILE_SIZE, height);
+    float sampleWeight = 1.0f / (sample + 1);
+    for (int y = tileBottom; y < tileTop; y++) {
+        for (int x = tileLeft; x < tileRight; x++) {
+            int index = width * y + x;
+            // every pixel and sample gets its own sequence, so the result doesn't depend on which thread traced what
+            uint32_t randomState = hashSeed((uint32_t) index * 0x9E3779B1u ^ (uint32_t) (sample + 1) * 0x85EBCA77u);
+
+            Vec3 direction = getPrimaryRay(cam, x + random(randomState), y + random(randomState));
+            Vec3 color = tracePath(cam.pos, direction, randomState);
+            float* sum = &accumulation[3 * index];
+            if (sample == 0) {
+                sum[0] = color.x;
+                sum[1] = color.y;
+                sum[2] = color.z;
+            } else {
+                sum[0] += color.x;
+                sum[1] += color.y;
+                sum[2] += color.z;
+            }
+            window.pixelArray.data[index] = PixelArray::packColor(
+                std::min(sum[0] * sampleWeight, 1.0f) * 255,
+                std::min(sum[1] * sampleWeight, 1.0f) * 255,
+                std::min(sum[2] * sampleWeight, 1.0f) * 255
+            );
+        }
+    }
+}
+Vec3 RayTracer::tracePath(Vec3 origin, Vec3 direction, uint32_t& randomState) const {
+    // radiance along the ray, in units of the triangle colors (1 is a color of 255)
+    Vec3 color(0, 0, 0);
+    Vec3 throughput(1, 1, 1);
+    for (int bounce = 0; bounce <= MAX_BOUNCES; bounce++) {
+        RayHit hit;
+        if (!Object3D::raycast(origin, direction, INFINITY, hit)) {
+            // the background stays black like when rasterizing, only light bouncing off something gets the ambient term
+            if (bounce > 0) {
+                color += throughput * AMBIENT;
+            }
+            break;
+        }
+        const Object3D& object = Object3D::objects[hit.objectIndex];
+        const Triangle& triangle = object.triangles[hit.triangleIndex];
+        Vec3 point = origin + direction * hit.distance;
+        // both sides of a triangle reflect
+        Vec3 normal = triangle.absoluteNormal;
+        if (normal.dot(direction) > 0) {
+            normal *= -1;
+        }
+        throughput.x *= triangle.r / 255.0f;
+        throughput.y *= triangle.g / 255.0f;
+        throughput.z *= triangle.b / 255.0f;
+
+        Vec3 light = directLight(point, normal);
+        color.x += throughput.x * light.x;
+        color.y += throughput.y * light.y;
+        color.z += throughput.z * light.z;
+
+        // cosine weighted direction around the normal, whose probability cancels the cosine of the diffuse reflection
+        float angle = 2 * M_PI * random(randomState);
+        float radiusSquared = random(randomState);
+        float radius = sqrt(radiusSquared);
+        Vec3 tangent = (fabs(normal.x) > 0.9f ? Vec3(0, 1, 0) : Vec3(1, 0, 0)).cross(normal);
+        tangent.normalize();
+        Vec3 bitangent = normal.cross(tangent);
+        direction = tangent * (radius * cos(angle)) + bitangent * (radius * sin(angle)) + normal * sqrt(1 - radiusSquared);
+        origin = point + normal * RAY_OFFSET;
+    }
+    return color;
+}
+Vec3 RayTracer::directLight(const Vec3& point, const Vec3& normal) const {
+    // the same falloff and spot cone as the rasterizer, with a shadow ray instead of the shadow map
+    float total = 0;
+    for (const Light& light : Light::lights) {
+        Vec3 toLight = light.cam.pos - point;
+        float distance = toLight.mag();
+        toLight *= 1 / distance;
+        float angleLighting = toLight.dot(normal);
+        if (angleLighting <= 0 || !light.mayLight(&point, 1)) {
+            continue;
+        }
+        if (Object3D::isOccluded(point + normal * RAY_OFFSET, toLight, distance - RAY_OFFSET)) {
+            continue;
+        }
+        total += DIFFUSE * std::min(light.luminosity / (distance * distance), 1.0f) * angleLighting;
+    }
+    return Vec3(total, total, total);
+}
+Vec3 RayTracer::getPrimaryRay(const Camera& cam, float x, float y) const {
+    // the point at camera space x = 1 behind screen position (x, y), same mapping as Triangle::shadePixel
+    float ndcX = 1 - 2 * x / width;
+    float ndcY = 1 - 2 * y / height;
+    float world[4];
+    cam.inverseViewProjection.transform(ndcX, ndcY, 1, 1, world);
+    Vec3 direction(world[0], world[1], world[2]);
+    direction *= 1 / world[3];
+    direction -= cam.pos;
+    direction.normalize();
+    return direction;
+}
+void RayTracer::pickCenter(Camera& cam) const {
+    // through the center of the pixel Window::pickCenter reads
+    Vec3 direction = getPrimaryRay(cam, width / 2 + 0.5f, height / 2 + 0.5f);
+    RayHit hit;
+    if (!Object3D::raycast(cam.pos, direction, INFINITY, hit)) {
+        cam.lookingAtObjectId = 0;
+        return;
+    }
+    cam.lookingAtObjectId = Object3D::objects[hit.objectIndex].id;
+    cam.lookingAtNormal = Object3D::objects[hit.objectIndex].triangles[hit.triangleIndex].absoluteNormal;
+    cam.lookingAtDepth = direction.dot(cam.direction) * hit.distance;
+}
+size_t RayTracer::getMemoryUsage() const {
+    return accumulation.capacity() * sizeof(float);
+}
+
+// STATIC METHODS
+float RayTracer::random(uint32_t& randomState) {
+    // xorshift32, the top 24 bits fill the mantissa
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return (randomState >> 8) * (1.0f / 16777216);
+}
 
 
 //-----------------------------------------------------------------------------------
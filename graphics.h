@@ -1,18 +1,28 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <cstdint>
 #include <memory>
 #include <vector>
 #include <mutex>
 
+namespace threads {
+    class TaskGroup;
+}
+
 namespace graphics {
 
 //---------------------------------------------------------------------------
 // FORWARD DECLARATION OF STRUCTS
 struct Vec3;
+struct Mat4;
 
 struct Point;
 struct Line;
 struct Triangle;
+struct BVH;
+struct RayHit;
 struct Object3D;
 
 struct Camera;
@@ -20,9 +30,14 @@ struct World;
 
 struct PixelArray;
 struct ZBuffer;
+struct VisibilityBuffer;
+struct EdgeRasterizer;
+struct RasterTriangle;
+struct TileBin;
 struct Window;
 
 struct Light;
+struct RayTracer;
 
 
 //---------------------------------------------------------------------------
@@ -64,6 +79,30 @@ Vec3 operator*(const float scalar, const Vec3& vec);
 Vec3 operator/(const float scalar, const Vec3& vec);
 
 
+//---------------------------------------------------------------------------
+// DECLARING "Mat4"
+// row major, m[row][column], points are column vectors with w = 1
+struct Mat4 {
+    float m[4][4];
+
+    // constructors
+    Mat4(); // identity
+
+    // operations
+    Mat4 operator*(const Mat4& other) const;
+    Vec3 transformPoint(const Vec3& vec) const; // ignores the bottom row, for affine matrices
+    void transform(float x, float y, float z, float w, float* out) const; // out gets all 4 components
+    // pushes count points given as separate x, y and z arrays through the matrix, 4 at a time with SIMD.
+    // outW may be nullptr for affine matrices
+    void transformPoints(int count, const float* x, const float* y, const float* z, float* outX, float* outY, float* outZ, float* outW) const;
+
+    // building matrices
+    static Mat4 translation(const Vec3& vec);
+    static Mat4 rotationZKnownTrig(float sinthetaZ, float costhetaZ); // same rotation as Vec3::rotateZKnownTrig
+    static Mat4 rotationYKnownTrig(float sinthetaY, float costhetaY); // same rotation as Vec3::rotateYKnownTrig
+};
+
+
 
 //---------------------------------------------------------------------------
 // DECLARING "Point"
@@ -102,47 +141,135 @@ struct Line {
 
 //---------------------------------------------------------------------------
 // DECLARING "Triangle"
+// one face of an Object3D, the corners are indices into the vertex buffer of that object
 struct Triangle {
     static std::vector<Triangle> triangles;
 
-    Point p1, p2, p3;
+    int v1, v2, v3;
     Vec3 absoluteNormal;
-    Vec3 cameraNormal;
     int r,g,b;
 
-    Triangle(Vec3 p1, Vec3 p2, Vec3 p3, int r, int g, int b);
-    Triangle(Point p1, Point p2, Point p3);
-    Triangle(Vec3 p1, Vec3 p2, Vec3 p3);
+    Triangle(int v1, int v2, int v3, Vec3 absoluteNormal, int r, int g, int b);
     Triangle();
 
-    void draw(Camera& cam, Window& window, const Object3D& object);
+    void draw(Camera& cam, Window& window, const Object3D& object) const;
 
-    static void drawVerticalScreenLine(Camera& cam, Window& window, const Triangle& triangle, const Object3D& object, int x, float y1, float y2, float d1);
-    static void drawVerticalScreenLine(Camera& cam, Window& window, const std::shared_ptr<Triangle> triangle, const Object3D& object, int x, float y1, float y2, float d1);
+    static int clipToNearPlane(const Point& p1, const Point& p2, const Point& p3, std::array<Point, 4>& clipped);
+    // lightIndices are the lights in Light::lights that can reach the pixel, usually Window::tileLights of its tile
+    static void shadePixel(Camera& cam, Window& window, const Triangle& triangle, int x, int y, float inverseDepth, const std::vector<int>& lightIndices);
+};
+
+
+//---------------------------------------------------------------------------
+// DECLARING "BVH"
+// Bounding volume hierarchy over items that only need a bounding box. Used for the triangles of
+// every mesh (Object3D::bvh) and for the objects of the scene (Object3D::sceneBVH).
+// build() splits with the binned surface area heuristic, building big subtrees on the thread pool.
+// insert() and remove() keep the tree and only refit the boxes, insert() rebuilds once the number of
+// items has doubled since the last build
+struct BVH {
+    static const int MAX_LEAF_SIZE = 4;
+    static const int SAH_BUCKETS = 12;
+    static const int PARALLEL_BUILD_SIZE = 1024; // subtrees with more items than this are built by their own task
+    static const int MAX_DEPTH = 64; // size of the traversal stacks, insert() rebuilds rather than go deeper
+    static const int INNER = -1; // Node::count of inner nodes
+
+    struct Node {
+        Vec3 boundsMin, boundsMax; // empty (min > max) for leaves that lost all their items
+        int first; // inner nodes: the first of the two children, leaves: the first of their entries in indices
+        int count; // number of items in a leaf, INNER for inner nodes
+    };
+
+    std::vector<Vec3> itemMin, itemMax; // bounds of every item, set before build() or refit()
+    std::vector<Node> nodes; // nodes[0] is the root, children always come after their parent
+    std::vector<int> indices; // item numbers, every leaf owns a range of them. -1 for entries nobody owns
+    int builtItems; // number of items at the last build()
+
+    BVH();
+
+    void build();
+    void refit(); // after itemMin or itemMax changed, keeps the tree
+    void insert(const Vec3& boundsMin, const Vec3& boundsMax); // the new item is numbered itemMin.size()
+    void remove(int item); // the items after it move down by one, like erasing from a vector
+
+    // onItem(item) is called for every item whose box the ray enters before maxDistance.
+    // It may lower maxDistance, which skips everything farther away
+    template <typename ItemFunc>
+    void traverseRay(const Vec3& origin, const Vec3& direction, float& maxDistance, ItemFunc onItem) const;
+
+    void buildNode(int nodeIndex, int first, int count, int depth, std::atomic<int>& nodesUsed, threads::TaskGroup& tasks);
+
+    static float surfaceArea(const Vec3& boundsMin, const Vec3& boundsMax);
+    static float rayBoxDistance(const Vec3& origin, const Vec3& inverseDirection, const Vec3& boundsMin, const Vec3& boundsMax); // INFINITY when missed
+};
+
+
+//---------------------------------------------------------------------------
+// DECLARING "RayHit"
+struct RayHit {
+    float distance;
+    int objectIndex; // into Object3D::objects, -1 when nothing was hit
+    int triangleIndex; // into the triangles of that object
 };
 
 
 //---------------------------------------------------------------------------
 // DECLARING "Object3D"
+// Indexed mesh. Every vertex is stored once, no matter how many triangles share it, and is
+// transformed once per frame by transformVertices() before the triangles are drawn
 struct Object3D {
+    static const int VERTEX_BATCH_SIZE = 256; // vertices transformed per task
+    static const int TRIANGLE_BATCH_SIZE = 16; // triangles drawn per task
+    static const int MIN_SPHERE_ITERATIONS = 8; // buildSphere() makes coarser levels of detail down to this many iterations
+    static constexpr float LOD_EDGE_PIXELS = 8; // generated levels of detail are drawn while their edges are at most this long on screen
+
     static std::vector<Object3D> objects;
     static int objectCounter;
+    std::vector<Point> vertices; // absolutePos is the mesh, the other positions are this frame's camera transform
     std::vector<Triangle> triangles;
     bool isDeletable;
     int id;
+    Vec3 boundsMin, boundsMax; // world space axis aligned bounding box
+    Vec3 boundsCenter; // world space bounding sphere around the center of the box, for frustum culling
+    float boundsRadius;
+    BVH bvh; // over triangles, rebuilt by updateBounds()
+
+    // coarser versions of the mesh for when the object is small on screen, coarsest last. They share this object's id,
+    // levelsOfDetail[i] is drawn while the bounding sphere is at most levelOfDetailMaxRadius[i] pixels in radius on screen.
+    // Only drawing uses them, shadows, rays and bounds always use the full mesh
+    std::vector<Object3D> levelsOfDetail;
+    std::vector<float> levelOfDetailMaxRadius;
+
+    // over the bounds of objects, item i is objects[i].
+    // NOTE: objects must be added and removed through addObject() and removeObject() to keep it in sync
+    static BVH sceneBVH;
 
     Object3D();
-    Object3D(std::vector<Triangle> triangles);
-    Object3D(std::vector<Triangle> triangles, bool isDeletable);
+    Object3D(std::vector<Point> vertices, std::vector<Triangle> triangles);
+    Object3D(std::vector<Point> vertices, std::vector<Triangle> triangles, bool isDeletable);
 
     bool operator==(const Object3D& other) const;
-    void drawMultithreaded(Camera& cam, Window& window);
-
-    static void removeObject(const Object3D& object);
+    int addVertex(Vec3 pos);
+    // NOTE: When points are given in clockwise order, the normal vector points towards the camera
+    void addTriangle(int v1, int v2, int v3, int r, int g, int b);
+    void updateBounds(); // also rebuilds bvh
+    bool isInFrustum(const Camera& cam, float aspect) const; // false only when no part of the object can be seen by cam
+    void addLevelOfDetail(Object3D mesh, float maxScreenRadius); // must be coarser than the levels added before
+    Object3D& getLevelOfDetail(const Camera& cam, const Window& window); // the mesh drawn this frame, *this for full detail
+    void transformVertices(const Camera& cam, const Window& window, threads::TaskGroup& tasks);
+    void drawMultithreaded(Camera& cam, Window& window, threads::TaskGroup& tasks);
+    // nearest triangle the ray hits before maxDistance, which is lowered to the hit. Both sides of triangles count.
+    // With anyHit the first triangle found is taken instead and maxDistance drops to 0
+    bool intersectRay(const Vec3& origin, const Vec3& direction, float& maxDistance, int& triangleIndex, bool anyHit = false) const;
+
+    static void addObject(const Object3D& object);
+    static bool removeObject(int id); // false when there is no such deletable object
+    static bool raycast(const Vec3& origin, const Vec3& direction, float maxDistance, RayHit& hit); // nearest hit in objects
+    static bool isOccluded(const Vec3& origin, const Vec3& direction, float maxDistance); // any hit in objects, for shadow rays
 
     // Making new objects
     static Object3D buildCube(Vec3 center, float sideLength, int r, int g, int b);
-    static Object3D buildSphere(Vec3 center, float radius, int iterations, int r, int g, int b);
+    static Object3D buildSphere(Vec3 center, float radius, int iterations, int r, int g, int b); // with levels of detail
     static Object3D buildCube(Vec3 center, float sideLength);
     static Object3D buildSphere(Vec3 center, float radius, int iterations);
 };
@@ -152,25 +279,38 @@ struct Object3D {
 //---------------------------------------------------------------------------
 // DECLARING "Camera"
 struct Camera {
+    static constexpr float NEAR_PLANE = 0.05; // minimum camera space x of anything that gets drawn
+
     Vec3 pos;
     float thetaZ, thetaY, sinthetaZ, sinthetaY, costhetaZ, costhetaY, fov, fov_rad, maxPlaneCoord, maxPlaneCoordInv;
     Vec3 direction;
     Vec3 floorDirection;
-    const Triangle* lookingAtTriangle;
-    const Object3D* lookingAtObject;
+
+    // view maps world space to camera space (x is depth). viewProjection maps world space to
+    // (ndcX, ndcY, 1, cameraX), so dividing by w gives the normalized screen position and the inverse depth.
+    // ndc runs from -1 to 1 over the field of view, the inverses go the other way.
+    // NOTE: updateMatrices() must be called after pos or the angles are changed directly
+    Mat4 view, inverseView, viewProjection, inverseViewProjection;
+
+    // what is at the center of the screen, read back from the visibility buffer by Window::pickCenter()
+    int lookingAtObjectId; // 0 when nothing is there
+    Vec3 lookingAtNormal; // absoluteNormal of the triangle there
+    float lookingAtDepth; // camera space x of the point there
 
     Camera(Vec3 pos, float thetaZ, float thetaY, float fov);
     Camera();
 
     void moveRelative(float forward, float sideward, float upward);
     void rotate(float thetaZ, float thetaY);
+    void updateMatrices();
+    void transformPoints(Point* points, int count, int width, int height) const;
     float getCameraYFromPixel(int x, int width) const;
     float getCameraZFromPixel(int y, int height) const;
-    float getCameraYFromPixelFast(int x, float widthInv) const;
-    float getCameraZFromPixelFast(int y, float heightInv) const;
+    // false when the sphere is entirely outside the frustum. aspect is height / width of the image it is drawn to
+    bool isSphereInFrustum(const Vec3& center, float radius, float aspect) const;
 
-    Vec3 getCenterOfViewPosition(Window& window) const;
-    Vec3 getPositionOfNewObject(Window& window) const;
+    Vec3 getCenterOfViewPosition() const; // uses what was picked last
+    Vec3 getPositionOfNewObject() const;
 };
 
 
@@ -185,90 +325,270 @@ struct World { // TODO: incomplete and unused
 
 //---------------------------------------------------------------------------
 // DECLARING "PixelArray"
-struct PixelArrayData {
-    int r, g ,b;
-    std::mutex mutex;
-
-    PixelArrayData(int r, int g, int b);
-    PixelArrayData(int color);
-    PixelArrayData(const PixelArrayData& other);
-    PixelArrayData();
-};
+// colors are packed as RGBA8 (r in the lowest byte), which is the byte order the canvas expects
 struct PixelArray {
+    static const int CLEAR_BATCH_SIZE = 16384; // pixels cleared per task
+
     int width, height;
-    std::vector<PixelArrayData> data;
+    std::vector<uint32_t> data;
 
     PixelArray(int width, int height);
 
     int getIndex(int x, int y);
     void setPixel(int x, int y, int color);
     void setPixel(int x, int y, int r, int g, int b);
-    void clear();
+    void clear(threads::TaskGroup& tasks);
+    size_t getMemoryUsage() const; // bytes
+
+    static uint32_t packColor(int r, int g, int b);
 };
 
 
 //---------------------------------------------------------------------------
 // DECLARING "ZBuffer"
-struct ZBufferData {
-    float depth;
-    std::mutex mutex;
-
-    ZBufferData(float depth);
-    ZBufferData(const ZBufferData& other);
-    ZBufferData();
-};
+// Stores inverse depth, 1 / cameraPos.x, because it is linear in screen space. Larger values are
+// nearer and 0 means nothing has been drawn.
+// NOTE: there are no locks, a ZBuffer must only be written by one thread per pixel at a time.
+// The camera pass guarantees this by giving every tile to a single task.
 struct ZBuffer {
+    // FLOAT32 stores the inverse depth as is in data. UNORM16 stores it in data16 as a fraction of
+    // maxInverseDepth rounded down, which is half the size and is enough for shadow maps.
+    // Anything nearer than 1 / maxInverseDepth is stored as if it were at that distance, so
+    // maxInverseDepth should be as small as the scene allows, the precision is maxInverseDepth / 65535
+    enum Format { FLOAT32, UNORM16 };
+
+    static constexpr float CLEAR_INVERSE_DEPTH = 0;
+    static const int CLEAR_BATCH_SIZE = 16384; // pixels cleared per task
+
     int width, height;
-    std::vector<ZBufferData> data;
+    Format format;
+    float maxInverseDepth; // only used by UNORM16
+    std::vector<float> data; // empty unless format is FLOAT32
+    std::vector<uint16_t> data16; // empty unless format is UNORM16
 
-    ZBuffer(int width, int height);
+    ZBuffer(int width, int height, Format format = FLOAT32, float maxInverseDepth = 1 / Camera::NEAR_PLANE);
 
     int getIndex(int x, int y);
-    void setDepth(int x, int y, float depth);
-    float getDepth(int x, int y);
-    void clear();
+    void setInverseDepth(int x, int y, float inverseDepth);
+    float getInverseDepth(int x, int y);
+    void clear(threads::TaskGroup& tasks);
+    void clear(threads::TaskGroup& tasks, int left, int right, int bottom, int top); // only the rectangle, inclusive
+    size_t getMemoryUsage() const; // bytes
+    uint16_t encodeUnorm16(float inverseDepth) const;
+    float decodeUnorm16(uint16_t value) const;
+};
+
+
+//---------------------------------------------------------------------------
+// DECLARING "VisibilityBuffer"
+// which triangle (and object) is visible at every pixel, filled by the rasterizer.
+// The pointers are only valid until the objects change, Window::pickCenter() turns them into ids
+struct VisibilityBuffer {
+    static const int CLEAR_BATCH_SIZE = 16384; // pixels cleared per task
+
+    int width, height;
+    std::vector<const Triangle*> triangles; // nullptr where nothing was drawn
+    std::vector<const Object3D*> objects;
+
+    VisibilityBuffer(int width, int height);
+
+    void clear(threads::TaskGroup& tasks);
+    size_t getMemoryUsage() const; // bytes
+};
+
+
+//---------------------------------------------------------------------------
+// DECLARING "EdgeRasterizer"
+// Half-space rasterizer. The three edge functions and the inverse depth plane of a screen-space
+// triangle are set up once, then coverage and depth are evaluated for 4x4 pixel blocks with SIMD.
+// Pixel (x, y) is sampled at screenPos (x, y).
+// Corners are snapped to a grid of 1 / 2^SUBPIXEL_BITS pixels and the edges are evaluated with integers,
+// so two triangles sharing an edge get exactly opposite values along it and every pixel center on it
+// is drawn by exactly one of them
+struct EdgeRasterizer {
+    static const int BLOCK_SIZE = 4;
+    static const int SUBPIXEL_BITS = 4;
+    // triangles with a corner farther than this many pixels from the origin are not drawn. It keeps the values of
+    // an edge that crosses a 4x4 block within 32 bits, so they fit simd::Int4 lanes. Near plane clipping keeps
+    // real scenes far inside it
+    static constexpr float GUARD_BAND = 1 << 19;
+
+    // edge i is edgeA[i] * x + edgeB[i] * y + edgeC[i] with x and y in subpixels, positive inside the triangle
+    int64_t edgeA[3], edgeB[3], edgeC[3];
+    bool edgeTopLeft[3]; // pixel centers exactly on the edge are drawn, it is a left edge or a horizontal top edge
+    float minX, maxX, minY, maxY; // bounding box of the snapped corners in screen coordinates
+
+    // inverse depth is (normal . ray) / d1 with ray = (1, cameraY, cameraZ), which is linear in x and y
+    float inverseDepthA, inverseDepthB, inverseDepthC;
+
+    bool setup(const Vec3& a, const Vec3& b, const Vec3& c, const Vec3& normal, float d1, const Camera& cam, int width, int height);
+
+    // calls onFragment(x, y, inverseDepth) for every pixel in [left, right] x [bottom, top] that passes the depth test
+    // with skipDepthTest set every covered pixel is written, for when the caller knows the triangle is in front
+    template <typename FragmentFunc>
+    void rasterize(ZBuffer& zBuffer, int left, int right, int bottom, int top, bool skipDepthTest, FragmentFunc onFragment) const;
+};
+
+
+//---------------------------------------------------------------------------
+// DECLARING "RasterTriangle" and "TileBin"
+// a triangle that has been projected to the screen and is waiting to be rasterized,
+// stored by value so the binning front-end and the tile back-end don't share any state
+struct RasterTriangle {
+    EdgeRasterizer edges;
+    float minInverseDepth, maxInverseDepth; // bounds over every point of the triangle, maxInverseDepth is the nearest
+    const Triangle* source;
+    const Object3D* object;
+};
+struct TileBin {
+    std::mutex mutex; // only taken while binning, the back-end owns the whole tile
+    std::vector<RasterTriangle> triangles;
 };
 
 
 //---------------------------------------------------------------------------
 // DECLARING "Window"
 struct Window {
+    static const int TILE_SIZE = 32;
+    static const int SHADE_BATCH_SIZE = 4; // rows shaded per task
+    static const int DRAW_BATCH_TRIANGLES = 1024; // triangles binned by drawObjects() before the tiles are rasterized
+
     int width, height;
     float widthInv, heightInv;
-    PixelArray pixelArray;
+    PixelArray pixelArray; // back buffer, the frame currently being drawn
+    PixelArray frontPixelArray; // last finished frame, handed out to js as-is
     ZBuffer zBuffer;
+    VisibilityBuffer visibilityBuffer;
+    int numTilesX, numTilesY;
+    std::vector<TileBin> tileBins;
+
+    // hierarchical z, the farthest (min) and nearest (max) inverse depth stored in each tile of zBuffer.
+    // Updated by the tile that owns it at the end of every rasterizeTiles pass, so it only rejects anything
+    // binned after a pass, see drawObjects()
+    std::vector<float> tileMinInverseDepth, tileMaxInverseDepth;
+
+    // indices into Light::lights of the lights that can reach any pixel drawn in each tile, so shading
+    // only pays for those. Filled by cullLights() when shading deferred, and by every rasterizeTiles pass otherwise
+    std::vector<std::vector<int> > tileLights;
+
+    // when set, rasterizing only fills zBuffer and visibilityBuffer and
+    // shadeVisibleTriangles() lights every pixel once, no matter how much overdraw there was
+    bool deferredShading;
 
     Window(int width, int height);
 
     void drawPoint(Point& point);
     void drawLine(Line& line);
-    void drawTriangle(Triangle& triangle, const Object3D& object, Camera& cam);
-    void drawTriangle(std::shared_ptr<Triangle> triangle, const Object3D& object, Camera& cam);
+    void drawTriangle(const Point& p1, const Point& p2, const Point& p3, const Vec3& cameraNormal, const Triangle& source, const Object3D& object, const Camera& cam);
+    void rasterizeTiles(Camera& cam, threads::TaskGroup& tasks);
+    void drawObjects(Camera& cam, std::vector<Object3D>& objects, threads::TaskGroup& tasks); // bins and rasterizes, nearest first
+    void rasterizeTile(Camera& cam, int tileX, int tileY);
+    bool isOccluded(float minX, float maxX, float minY, float maxY, float maxInverseDepth) const;
+    bool isOccluded(const Object3D& object, const Camera& cam) const;
+    void pickCenter(Camera& cam) const;
+    void cullLights(Camera& cam, threads::TaskGroup& tasks); // after the last rasterizeTiles pass
+    void cullTileLights(const Camera& cam, int tileX, int tileY, float minInverseDepth, float maxInverseDepth);
+    void shadeVisibleTriangles(Camera& cam, threads::TaskGroup& tasks);
+    void shadeRow(Camera& cam, int y);
     void draw(); // implementation specific
-    void getUint8Pointer(uint8_t* buffer); // implementation specific
-    void clear();
+    uint8_t* swapBuffers(); // implementation specific
+    void clear(threads::TaskGroup& tasks);
+    size_t getMemoryUsage() const; // bytes in every buffer of the window, including the tile bins
 };
 
 
 //---------------------------------------------------------------------------
 // DECLARING "Light"
 struct Light {
+    static const int TILE_SIZE = 256; // shadow map pixels per side rasterized by one task
+    static const int DEFAULT_SHADOW_MAP_SIZE = 4000; // FLOAT32 by default
+    static const int BIN_BATCH_SIZE = 256; // triangles sorted into shadow map tiles per task
+    static const int MOMENTS_BATCH_SIZE = 16; // rows of moments blurred per task
+    static constexpr float MIN_RELATIVE_VARIANCE = 1e-6; // variance never goes below this times the mean squared, hides acne
+    static constexpr float MIN_INTENSITY = 1.0f / 512; // lights are culled where luminosity / distance^2 is below this
+
+    static constexpr float SHADOW_RAY_OFFSET = 1e-3; // RAYTRACED shadow rays start this far off the surface
+
+    // PCF compares 25 shadow map pixels around every shaded point. VARIANCE keeps the mean and standard deviation
+    // of the inverse depth over the same 5x5 area in moments, blurred whenever the shadow map changes,
+    // and estimates how much of that area is nearer than the point from a single fetch.
+    // RAYTRACED has no shadow map at all, it casts a ray from every shaded point towards the light through
+    // Object3D::sceneBVH. The shadows are hard, but exact at any distance and scene edits cost nothing
+    enum Filtering { PCF, VARIANCE, RAYTRACED };
+
+    // the pixels of zBuffer an object was rasterized into, inclusive
+    struct ShadowRegion {
+        int objectId;
+        int left, right, bottom, top;
+    };
+
     Camera cam;
-    ZBuffer zBuffer;
+    ZBuffer zBuffer; // keeps its size but holds no pixels while filtering is RAYTRACED
+    Filtering filtering;
     int filteringRadius;
     float luminosity, filteringAreaInv;
+    std::vector<ShadowRegion> objectRegions; // one per object in zBuffer
+    // 2 per pixel of zBuffer (mean, standard deviation), empty unless filtering is VARIANCE. Stored like zBuffer,
+    // as is in moments for FLOAT32 and as fractions of zBuffer.maxInverseDepth in moments16 for UNORM16,
+    // the mean rounded down and the deviation rounded up so the error errs on the side of lit
+    std::vector<float> moments;
+    std::vector<uint16_t> moments16;
 
     static std::vector<Light> lights;
 
+    // shadowMapNearDistance is the nearest distance the shadow map has to tell apart, see ZBuffer::maxInverseDepth
+    Light(Vec3 pos, float thetaZ, float thetaY, float fov, float luminosity, int shadowMapSize, ZBuffer::Format shadowMapFormat, float shadowMapNearDistance);
     Light(Vec3 pos, float thetaZ, float thetaY, float fov, float luminosity);
     Light(Vec3 pos, float thetaZ, float thetaY, float luminosity);
 
-    void getTrianglePerspectiveFromLight(Triangle triangle);
-    void addTriangleToZBuffer(Triangle& triangle);
-    void fillZBuffer(std::vector<Triangle>& triangles);
+    int getTrianglePerspectiveFromLight(const Triangle& triangle, const std::vector<Point>& vertices, EdgeRasterizer* edges) const;
+    bool setupTriangleEdges(const Point& a, const Point& b, const Point& c, EdgeRasterizer& edges) const;
+    void fillZBuffer(const Object3D& object);
+    void fillZBuffer(const Object3D& object, int left, int right, int bottom, int top);
+    ShadowRegion rasterizeObject(const Object3D& object, int left, int right, int bottom, int top); // returns the pixels it drew into
+    void removeFromZBuffer(int objectId, const std::vector<Object3D>& remainingObjects);
+    // the shadow map is freed for RAYTRACED, and redrawn from objects when switching back from it
+    void setFiltering(Filtering filtering, const std::vector<Object3D>& objects);
+    void updateMoments(int left, int right, int bottom, int top); // after the rectangle of zBuffer changed, inclusive
+
+    float amountLit(Vec3& vec, const Vec3& normal, float& vecToLightMagInv); // normal faces the light, only RAYTRACED uses it
+    bool mayLight(const Vec3* corners, int numCorners) const; // false when no point in the convex hull of corners can be lit
+    size_t getMemoryUsage() const; // bytes, the shadow map, its object regions and moments
+
+    static size_t getTotalMemoryUsage(); // bytes in the shadow maps of every light in lights
+};
 
-    float amountLit(Vec3& vec, float& vecToLightMagInv);
+//---------------------------------------------------------------------------
+// DECLARING "RayTracer"
+// Progressive path tracer over Object3D::objects and Light::lights, an alternative to rasterizing
+// that also gets indirect light. Every render() traces one more jittered sample per pixel and writes the
+// average of all samples so far into the window's back buffer, so the image keeps improving for as long
+// as the camera stays still. It starts over by itself when the camera moves, reset() is for scene changes
+struct RayTracer {
+    static const int TILE_SIZE = 16; // pixels per side traced by one task
+    static const int MAX_BOUNCES = 2; // diffuse bounces after the first hit
+    static constexpr float RAY_OFFSET = 1e-3; // rays leaving a surface start this far off it
+    // same weights as Triangle::shadePixel, the ambient light comes from rays that escape the scene
+    static constexpr float AMBIENT = 0.2;
+    static constexpr float DIFFUSE = 0.8;
 
+    int width, height;
+    std::vector<float> accumulation; // 3 per pixel, the sum of every sample so far. Only allocated once used
+    int numSamples;
+    Mat4 sampledViewProjection; // camera the samples were traced with
+
+    RayTracer(int width, int height);
+
+    void reset();
+    void render(const Camera& cam, Window& window, threads::TaskGroup& tasks); // wait for tasks before reading the window
+    void traceTile(const Camera& cam, Window& window, int tileX, int tileY, int sample);
+    Vec3 tracePath(Vec3 origin, Vec3 direction, uint32_t& randomState) const;
+    Vec3 directLight(const Vec3& point, const Vec3& normal) const;
+    Vec3 getPrimaryRay(const Camera& cam, float x, float y) const; // through screen position (x, y), normalized
+    void pickCenter(Camera& cam) const; // same as Window::pickCenter, with a ray instead of the visibility buffer
+    size_t getMemoryUsage() const; // bytes
+
+    static float random(uint32_t& randomState); // uniform in [0, 1)
 };
 
 //---------------------------------------------------------------------------
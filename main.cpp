@@ -16,12 +16,66 @@ static bool running = true;
 static graphics::Window window(500, 500);
 static graphics::Camera cam;
 
-// Setting up buffer
-static uint8_t* buffer = new uint8_t[window.width * window.height * 4];
-
 // Ghost object
 static graphics::Object3D ghostObject;
 
+// Pipelining. When set, EXTERN_getBuffer returns the frame that was rendered in the background since
+// the previous call and starts rendering the next one before returning, so the workers keep going while
+// js presents the frame and handles input. This adds one frame of latency.
+// The window's back buffer is free for the next frame as soon as the finished one is swapped to the front.
+static bool pipelined = false;
+static bool frameInFlight = false; // the back buffer holds, or is being filled with, the next frame
+static threads::TaskGroup frameTasks; // the frame being rendered in the background, wait() on it before changing the scene
+static graphics::Camera frameCam; // copy of cam taken when that frame was started, input may move cam meanwhile
+
+// Ray tracing. When set, frames are path traced instead of rasterized, adding a sample per pixel every frame
+static bool rayTracing = false;
+static graphics::RayTracer rayTracer(500, 500);
+
+// Renders the scene into window's back buffer
+static void renderFrame(graphics::Camera& camera) {
+    // every phase waits only for its own tasks, and helps running them while it waits
+    threads::TaskGroup tasks;
+
+    // the path tracer replaces every pass below, the ghost object is only placed, not drawn
+    if (rayTracing) {
+        rayTracer.render(camera, window, tasks);
+        tasks.wait();
+        rayTracer.pickCenter(camera);
+        ghostObject = graphics::Object3D::buildCube(camera.getPositionOfNewObject(), 1, 120, 120, 120);
+        return;
+    }
+
+    // CLEARING WINDOW
+    window.clear(tasks);
+    tasks.wait();
+
+    // TRANSFORMING VERTICES
+    for (graphics::Object3D &o : graphics::Object3D::objects) {
+        o.transformVertices(camera, window, tasks);
+    }
+    tasks.wait();
+
+    // DRAWING TRIANGLES
+    window.drawObjects(camera, graphics::Object3D::objects, tasks);
+    window.pickCenter(camera);
+
+    // DRAWING GHOST TRIANGLES
+    ghostObject = graphics::Object3D::buildCube(camera.getPositionOfNewObject(), 1, 120, 120, 120);
+    ghostObject.transformVertices(camera, window, tasks);
+    tasks.wait();
+    ghostObject.drawMultithreaded(camera, window, tasks);
+    tasks.wait();
+    window.rasterizeTiles(camera, tasks);
+    tasks.wait();
+
+    // SHADING VISIBLE TRIANGLES
+    window.cullLights(camera, tasks);
+    tasks.wait();
+    window.shadeVisibleTriangles(camera, tasks);
+    tasks.wait();
+}
+
 extern "C" {
     EMSCRIPTEN_KEEPALIVE
     void EXTERN_setupScene() {
@@ -29,53 +83,44 @@ extern "C" {
         floorGrid.isDeletable = false;
         bool floorGridColor = true;
         int floorGridSize = 12;
-        for (int i = -floorGridSize / 2; i < floorGridSize / 2; i++) {
+        // (floorGridSize + 1)^2 shared vertices, vertex (i, j) is at index (i + floorGridSize / 2) * (floorGridSize + 1) + j + floorGridSize / 2
+        for (int i = -floorGridSize / 2; i <= floorGridSize / 2; i++) {
+            for (int j = -floorGridSize / 2; j <= floorGridSize / 2; j++) {
+                floorGrid.addVertex(graphics::Vec3(i, j, 0));
+            }
+        }
+        for (int i = 0; i < floorGridSize; i++) {
             floorGridColor = !floorGridColor;
-            for (int j = -floorGridSize / 2; j < floorGridSize / 2; j++) {
+            for (int j = 0; j < floorGridSize; j++) {
                 floorGridColor = !floorGridColor;
-                graphics::Point p1(i, j, 0);
-                graphics::Point p2(i+1, j, 0);
-                graphics::Point p3(i, j+1, 0);
-                graphics::Point p4(i+1, j+1, 0);
-
-                graphics::Triangle t1(p4, p2, p1);
-                graphics::Triangle t2(p1, p3, p4);
-                if (floorGridColor) {
-                    t1.r = 200;
-                    t1.g = 200;
-                    t1.b = 200;
-                    t2.r = 200;
-                    t2.g = 200;
-                    t2.b = 200;
-                } else {
-                    t1.r = 150;
-                    t1.g = 150;
-                    t1.b = 150;
-                    t2.r = 150;
-                    t2.g = 150;
-                    t2.b = 150;
-                }
-                floorGrid.triangles.push_back(t1);
-                floorGrid.triangles.push_back(t2);
+                int p1 = i * (floorGridSize + 1) + j;
+                int p2 = (i + 1) * (floorGridSize + 1) + j;
+                int p3 = i * (floorGridSize + 1) + j + 1;
+                int p4 = (i + 1) * (floorGridSize + 1) + j + 1;
+
+                int color = floorGridColor ? 200 : 150;
+                floorGrid.addTriangle(p4, p2, p1, color, color, color);
+                floorGrid.addTriangle(p1, p3, p4, color, color, color);
             }
         }
-        graphics::Object3D::objects.push_back(floorGrid);
+        floorGrid.updateBounds();
+        graphics::Object3D::addObject(floorGrid);
 
         graphics::Vec3 lightPos(-50, 0, 50);
-        graphics::Light l1(lightPos, 0, -M_PI / 4.0, 10, 4000);
-        graphics::Light::lights.push_back(l1);
+        graphics::Light::lights.emplace_back(lightPos, 0, -M_PI / 4.0, 10, 4000);
 
-        graphics::Object3D::objects.push_back(graphics::Object3D::buildCube(graphics::Vec3(0.5, -0.5, 0.5), 1));
-        graphics::Object3D::objects.push_back(graphics::Object3D::buildSphere(graphics::Vec3(3.5, -0.5, 0.5), 1, 40, 255, 200, 200));
+        graphics::Object3D::addObject(graphics::Object3D::buildCube(graphics::Vec3(0.5, -0.5, 0.5), 1));
+        graphics::Object3D::addObject(graphics::Object3D::buildSphere(graphics::Vec3(3.5, -0.5, 0.5), 1, 40));
 
         for (graphics::Light &l : graphics::Light::lights) {
             for (graphics::Object3D &o : graphics::Object3D::objects) {
-                l.fillZBuffer(o.triangles);
+                l.fillZBuffer(o);
             }
         }
 
         cam.pos.y = -2;
         cam.pos.z = 2;
+        cam.updateMatrices();
     }
 }
 
@@ -84,40 +129,35 @@ extern "C" {
     uint8_t* EXTERN_getBuffer() {
         auto start = std::chrono::high_resolution_clock::now();
 
-        // CLEARING WINDOW
-        window.clear();
-        while (threads::threadPool.getNumberOfActiveTasks() > 0) {
-            std::this_thread::sleep_for(std::chrono::microseconds(200));
-        }
-
-        // DRAWING TRIANGLES
-        for (graphics::Object3D &o : graphics::Object3D::objects) {
-            o.drawMultithreaded(cam, window);
-        }
-        while (threads::threadPool.getNumberOfActiveTasks() > 0) {
-            std::this_thread::sleep_for(std::chrono::microseconds(200));
-        }
-        const graphics::Triangle* lookingAtTriangle = cam.lookingAtTriangle;
-        const graphics::Object3D* lookingAtObject = cam.lookingAtObject;
-
-        // DRAWING GHOST TRIANGLES
-        ghostObject = graphics::Object3D::buildCube(cam.getPositionOfNewObject(window), 1, 120, 120, 120);
-        ghostObject.drawMultithreaded(cam, window);
-        while (threads::threadPool.getNumberOfActiveTasks() > 0) {
-            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        uint8_t* buffer;
+        if (pipelined) {
+            // the first call has nothing rendered yet and waits for a full frame
+            if (!frameInFlight) {
+                frameCam = cam;
+                renderFrame(frameCam);
+                frameInFlight = true;
+            }
+            frameTasks.wait();
+            cam.lookingAtObjectId = frameCam.lookingAtObjectId;
+            cam.lookingAtNormal = frameCam.lookingAtNormal;
+            cam.lookingAtDepth = frameCam.lookingAtDepth;
+            buffer = window.swapBuffers();
+
+            // start the next frame, it draws into the back buffer while js uses the one returned here
+            frameCam = cam;
+            frameInFlight = true;
+            frameTasks.addTask([] {
+                renderFrame(frameCam);
+            });
+        } else {
+            renderFrame(cam);
+            buffer = window.swapBuffers();
         }
 
-        cam.lookingAtTriangle = lookingAtTriangle;
-        cam.lookingAtObject = lookingAtObject;
-
         auto end = std::chrono::high_resolution_clock::now();
         std::chrono::duration<double> elapsed = end - start;
-        window.getUint8Pointer(buffer);
-        while (threads::threadPool.getNumberOfActiveTasks() > 0) {
-            std::this_thread::sleep_for(std::chrono::microseconds(200));
-        }
         std::cout << "returning buffer, elapsed time: " << elapsed.count() << std::endl;
-        return &buffer[0];
+        return buffer;
     }
 }
 
@@ -129,26 +169,75 @@ extern "C" {
         float rotateMultiplier = 0.01;
         cam.rotate(rotateMultiplier * cameraRotateZ, rotateMultiplier * cameraRotateY);
 
+        // the scene can only change while no frame is being rendered
+        if (userInputCode != 0) {
+            frameTasks.wait();
+            rayTracer.reset();
+        }
+
         if (userInputCode == 1) {
-            graphics::Object3D::objects.push_back(ghostObject);
+            graphics::Object3D::addObject(ghostObject);
             for (graphics::Light &l : graphics::Light::lights) {
-                l.fillZBuffer(ghostObject.triangles);
+                l.fillZBuffer(ghostObject);
             }
-        } else if (userInputCode == 2) {
-            graphics::Object3D::removeObject(*cam.lookingAtObject);
-            for (graphics::Light &l : graphics::Light::lights) {
-                l.zBuffer.clear();
-                while (threads::threadPool.getNumberOfActiveTasks() > 0) {
-                    std::this_thread::sleep_for(std::chrono::microseconds(200));
-                }
-                for (graphics::Object3D &o : graphics::Object3D::objects) {
-                    l.fillZBuffer(o.triangles);
+        } else if (userInputCode == 2 && cam.lookingAtObjectId != 0) {
+            int id = cam.lookingAtObjectId;
+            cam.lookingAtObjectId = 0;
+            if (graphics::Object3D::removeObject(id)) {
+                for (graphics::Light &l : graphics::Light::lights) {
+                    l.removeFromZBuffer(id, graphics::Object3D::objects);
                 }
             }
         }
     }
 }
 
+extern "C" {
+    // enabled != 0 turns on pipelined rendering, trading one frame of latency for throughput
+    EMSCRIPTEN_KEEPALIVE
+    void EXTERN_setPipelined(int enabled) {
+        // a frame left in the back buffer would be drawn over by the next synchronous frame anyway
+        frameTasks.wait();
+        frameInFlight = false;
+        pipelined = enabled != 0;
+    }
+}
+
+extern "C" {
+    // enabled != 0 path traces frames instead of rasterizing them, the buffer from EXTERN_getBuffer keeps the same format
+    EMSCRIPTEN_KEEPALIVE
+    void EXTERN_setRayTracing(int enabled) {
+        // a frame in flight was rendered the other way, drop it
+        frameTasks.wait();
+        frameInFlight = false;
+        rayTracing = enabled != 0;
+        rayTracer.reset();
+    }
+}
+
+extern "C" {
+    // filtering for every light: 0 is PCF, 1 variance shadow maps, which cost one fetch per shaded pixel instead of 25,
+    // and 2 ray traced shadows, which free the shadow maps and make adding and removing objects cheaper
+    EMSCRIPTEN_KEEPALIVE
+    void EXTERN_setShadowFiltering(int filtering) {
+        frameTasks.wait();
+        graphics::Light::Filtering mode = filtering == 1 ? graphics::Light::VARIANCE : filtering == 2 ? graphics::Light::RAYTRACED : graphics::Light::PCF;
+        for (graphics::Light &l : graphics::Light::lights) {
+            l.setFiltering(mode, graphics::Object3D::objects);
+        }
+    }
+}
+
+extern "C" {
+    // bytes held by the window's buffers, every shadow map and the thread pool's deques, for keeping the heap within a budget
+    EMSCRIPTEN_KEEPALIVE
+    double EXTERN_getMemoryUsage() {
+        // the tile bins grow while a frame is being rendered
+        frameTasks.wait();
+        return window.getMemoryUsage() + graphics::Light::getTotalMemoryUsage() + rayTracer.getMemoryUsage() + threads::threadPool.getMemoryUsage();
+    }
+}
+
 int main(int, char**){
     std::cout << "Hello, from main!" << std::endl;
     return 0;
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Thin wrapper around 4-wide float and 32 bit integer vectors. Uses wasm simd128 in the browser build (-msimd128),
+// SSE2 on native x86 builds and plain arrays everywhere else.
+// Masks are Float4s or Int4s whose lanes are either all ones or all zeros.
+namespace simd {
+
+    struct Float4 {
+    #if defined(__wasm_simd128__)
+        v128_t v;
+    #elif defined(__SSE2__)
+        __m128 v;
+    #else
+        float v[4];
+    #endif
+    };
+    struct Int4 {
+    #if defined(__wasm_simd128__)
+        v128_t v;
+    #elif defined(__SSE2__)
+        __m128i v;
+    #else
+        int32_t v[4];
+    #endif
+    };
+
+#if defined(__wasm_simd128__)
+
+    inline Float4 set1(float a) { return {wasm_f32x4_splat(a)}; }
+    inline Float4 set(float a, float b, float c, float d) { return {wasm_f32x4_make(a, b, c, d)}; }
+    inline Float4 load(const float* p) { return {wasm_v128_load(p)}; }
+    inline void store(float* p, Float4 a) { wasm_v128_store(p, a.v); }
+
+    inline Float4 operator+(Float4 a, Float4 b) { return {wasm_f32x4_add(a.v, b.v)}; }
+    inline Float4 operator-(Float4 a, Float4 b) { return {wasm_f32x4_sub(a.v, b.v)}; }
+    inline Float4 operator*(Float4 a, Float4 b) { return {wasm_f32x4_mul(a.v, b.v)}; }
+    inline Float4 operator/(Float4 a, Float4 b) { return {wasm_f32x4_div(a.v, b.v)}; }
+    inline Float4 sqrt(Float4 a) { return {wasm_f32x4_sqrt(a.v)}; }
+    inline Float4 min(Float4 a, Float4 b) { return {wasm_f32x4_pmin(a.v, b.v)}; }
+    inline Float4 max(Float4 a, Float4 b) { return {wasm_f32x4_pmax(a.v, b.v)}; }
+
+    inline Float4 cmplt(Float4 a, Float4 b) { return {wasm_f32x4_lt(a.v, b.v)}; }
+    inline Float4 cmpgt(Float4 a, Float4 b) { return {wasm_f32x4_gt(a.v, b.v)}; }
+    inline Float4 cmpge(Float4 a, Float4 b) { return {wasm_f32x4_ge(a.v, b.v)}; }
+    inline Float4 operator&(Float4 a, Float4 b) { return {wasm_v128_and(a.v, b.v)}; }
+    inline Float4 operator|(Float4 a, Float4 b) { return {wasm_v128_or(a.v, b.v)}; }
+    // lanes of a where mask is set, lanes of b otherwise
+    inline Float4 select(Float4 mask, Float4 a, Float4 b) { return {wasm_v128_bitselect(a.v, b.v, mask.v)}; }
+    inline int movemask(Float4 mask) { return wasm_i32x4_bitmask(mask.v); }
+
+    inline Int4 set1i(int32_t a) { return {wasm_i32x4_splat(a)}; }
+    inline Int4 seti(int32_t a, int32_t b, int32_t c, int32_t d) { return {wasm_i32x4_make(a, b, c, d)}; }
+    inline Int4 operator+(Int4 a, Int4 b) { return {wasm_i32x4_add(a.v, b.v)}; }
+    inline Int4 cmpgt(Int4 a, Int4 b) { return {wasm_i32x4_gt(a.v, b.v)}; }
+    inline Int4 operator&(Int4 a, Int4 b) { return {wasm_v128_and(a.v, b.v)}; }
+    inline int movemask(Int4 mask) { return wasm_i32x4_bitmask(mask.v); }
+
+#elif defined(__SSE2__)
+
+    inline Float4 set1(float a) { return {_mm_set1_ps(a)}; }
+    inline Float4 set(float a, float b, float c, float d) { return {_mm_setr_ps(a, b, c, d)}; }
+    inline Float4 load(const float* p) { return {_mm_loadu_ps(p)}; }
+    inline void store(float* p, Float4 a) { _mm_storeu_ps(p, a.v); }
+
+    inline Float4 operator+(Float4 a, Float4 b) { return {_mm_add_ps(a.v, b.v)}; }
+    inline Float4 operator-(Float4 a, Float4 b) { return {_mm_sub_ps(a.v, b.v)}; }
+    inline Float4 operator*(Float4 a, Float4 b) { return {_mm_mul_ps(a.v, b.v)}; }
+    inline Float4 operator/(Float4 a, Float4 b) { return {_mm_div_ps(a.v, b.v)}; }
+    inline Float4 sqrt(Float4 a) { return {_mm_sqrt_ps(a.v)}; }
+    inline Float4 min(Float4 a, Float4 b) { return {_mm_min_ps(a.v, b.v)}; }
+    inline Float4 max(Float4 a, Float4 b) { return {_mm_max_ps(a.v, b.v)}; }
+
+    inline Float4 cmplt(Float4 a, Float4 b) { return {_mm_cmplt_ps(a.v, b.v)}; }
+    inline Float4 cmpgt(Float4 a, Float4 b) { return {_mm_cmpgt_ps(a.v, b.v)}; }
+    inline Float4 cmpge(Float4 a, Float4 b) { return {_mm_cmpge_ps(a.v, b.v)}; }
+    inline Float4 operator&(Float4 a, Float4 b) { return {_mm_and_ps(a.v, b.v)}; }
+    inline Float4 operator|(Float4 a, Float4 b) { return {_mm_or_ps(a.v, b.v)}; }
+    // lanes of a where mask is set, lanes of b otherwise
+    inline Float4 select(Float4 mask, Float4 a, Float4 b) { return {_mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v))}; }
+    inline int movemask(Float4 mask) { return _mm_movemask_ps(mask.v); }
+
+    inline Int4 set1i(int32_t a) { return {_mm_set1_epi32(a)}; }
+    inline Int4 seti(int32_t a, int32_t b, int32_t c, int32_t d) { return {_mm_setr_epi32(a, b, c, d)}; }
+    inline Int4 operator+(Int4 a, Int4 b) { return {_mm_add_epi32(a.v, b.v)}; }
+    inline Int4 cmpgt(Int4 a, Int4 b) { return {_mm_cmpgt_epi32(a.v, b.v)}; }
+    inline Int4 operator&(Int4 a, Int4 b) { return {_mm_and_si128(a.v, b.v)}; }
+    inline int movemask(Int4 mask) { return _mm_movemask_ps(_mm_castsi128_ps(mask.v)); }
+
+#else
+
+    inline Float4 set1(float a) { return {{a, a, a, a}}; }
+    inline Float4 set(float a, float b, float c, float d) { return {{a, b, c, d}}; }
+    inline Float4 load(const float* p) { return {{p[0], p[1], p[2], p[3]}}; }
+    inline void store(float* p, Float4 a) { std::memcpy(p, a.v, sizeof(a.v)); }
+
+    inline Float4 operator+(Float4 a, Float4 b) { return {{a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3]}}; }
+    inline Float4 operator-(Float4 a, Float4 b) { return {{a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2], a.v[3] - b.v[3]}}; }
+    inline Float4 operator*(Float4 a, Float4 b) { return {{a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3]}}; }
+    inline Float4 operator/(Float4 a, Float4 b) { return {{a.v[0] / b.v[0], a.v[1] / b.v[1], a.v[2] / b.v[2], a.v[3] / b.v[3]}}; }
+    inline Float4 sqrt(Float4 a) { return {{__builtin_sqrtf(a.v[0]), __builtin_sqrtf(a.v[1]), __builtin_sqrtf(a.v[2]), __builtin_sqrtf(a.v[3])}}; }
+    inline Float4 min(Float4 a, Float4 b) { return {{a.v[0] < b.v[0] ? a.v[0] : b.v[0], a.v[1] < b.v[1] ? a.v[1] : b.v[1], a.v[2] < b.v[2] ? a.v[2] : b.v[2], a.v[3] < b.v[3] ? a.v[3] : b.v[3]}}; }
+    inline Float4 max(Float4 a, Float4 b) { return {{a.v[0] > b.v[0] ? a.v[0] : b.v[0], a.v[1] > b.v[1] ? a.v[1] : b.v[1], a.v[2] > b.v[2] ? a.v[2] : b.v[2], a.v[3] > b.v[3] ? a.v[3] : b.v[3]}}; }
+
+    inline float maskLane(bool set) {
+        uint32_t bits = set ? 0xFFFFFFFFu : 0;
+        float f;
+        std::memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+    inline uint32_t laneBits(float f) {
+        uint32_t bits;
+        std::memcpy(&bits, &f, sizeof(bits));
+        return bits;
+    }
+    inline Float4 cmplt(Float4 a, Float4 b) { return {{maskLane(a.v[0] < b.v[0]), maskLane(a.v[1] < b.v[1]), maskLane(a.v[2] < b.v[2]), maskLane(a.v[3] < b.v[3])}}; }
+    inline Float4 cmpgt(Float4 a, Float4 b) { return cmplt(b, a); }
+    inline Float4 cmpge(Float4 a, Float4 b) { return {{maskLane(a.v[0] >= b.v[0]), maskLane(a.v[1] >= b.v[1]), maskLane(a.v[2] >= b.v[2]), maskLane(a.v[3] >= b.v[3])}}; }
+    inline Float4 operator&(Float4 a, Float4 b) {
+        Float4 result;
+        for (int i = 0; i < 4; i++) {
+            uint32_t bits = laneBits(a.v[i]) & laneBits(b.v[i]);
+            std::memcpy(&result.v[i], &bits, sizeof(float));
+        }
+        return result;
+    }
+    inline Float4 operator|(Float4 a, Float4 b) {
+        Float4 result;
+        for (int i = 0; i < 4; i++) {
+            uint32_t bits = laneBits(a.v[i]) | laneBits(b.v[i]);
+            std::memcpy(&result.v[i], &bits, sizeof(float));
+        }
+        return result;
+    }
+    // lanes of a where mask is set, lanes of b otherwise
+    inline Float4 select(Float4 mask, Float4 a, Float4 b) {
+        return {{laneBits(mask.v[0]) ? a.v[0] : b.v[0], laneBits(mask.v[1]) ? a.v[1] : b.v[1], laneBits(mask.v[2]) ? a.v[2] : b.v[2], laneBits(mask.v[3]) ? a.v[3] : b.v[3]}};
+    }
+    inline int movemask(Float4 mask) {
+        return (laneBits(mask.v[0]) >> 31) | ((laneBits(mask.v[1]) >> 31) << 1) | ((laneBits(mask.v[2]) >> 31) << 2) | ((laneBits(mask.v[3]) >> 31) << 3);
+    }
+
+    inline Int4 set1i(int32_t a) { return {{a, a, a, a}}; }
+    inline Int4 seti(int32_t a, int32_t b, int32_t c, int32_t d) { return {{a, b, c, d}}; }
+    inline Int4 operator+(Int4 a, Int4 b) { return {{a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3]}}; }
+    inline Int4 cmpgt(Int4 a, Int4 b) { return {{-(a.v[0] > b.v[0]), -(a.v[1] > b.v[1]), -(a.v[2] > b.v[2]), -(a.v[3] > b.v[3])}}; }
+    inline Int4 operator&(Int4 a, Int4 b) { return {{a.v[0] & b.v[0], a.v[1] & b.v[1], a.v[2] & b.v[2], a.v[3] & b.v[3]}}; }
+    inline int movemask(Int4 mask) {
+        return (mask.v[0] & 1) | ((mask.v[1] & 1) << 1) | ((mask.v[2] & 1) << 2) | ((mask.v[3] & 1) << 3);
+    }
+
+#endif
+
+    inline Float4 allOnes() { return cmpge(set1(0), set1(0)); }
+}
@@ -1,5 +1,7 @@
 #include "threads.h"
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <functional>
 #include <thread>
 #include <mutex>
@@ -8,79 +10,251 @@
 
 using namespace threads;
 
+// the pool and deque the current thread works on, nullptr and -1 outside of worker threads
+static thread_local ThreadPool* current_pool = nullptr;
+static thread_local int worker_index = -1;
+
+// must not be more than -sPTHREAD_POOL_SIZE in CMakeLists.txt
+static const int MAX_THREADS = 30;
+
 // CONSTRUCTOR
-ThreadPool threadPool = ThreadPool(20);
-ThreadPool::ThreadPool(int num_threads) : stop_(false), active_tasks_(0) {
-    // Creating worker threads 
-    for (int i = 0; i < num_threads; ++i) { 
-        threads_.emplace_back([this] { 
-            while (true) { 
-                std::function<void()> task; 
-                // The reason for putting the below code 
-                // here is to unlock the queue before 
-                // executing the task so that other 
-                // threads can perform enqueue tasks 
-                { 
-                    // Locking the queue so that data 
-                    // can be shared safely 
-                    std::unique_lock<std::mutex> lock( 
-                        queue_mutex_); 
-
-                    // Waiting until there is a task to 
-                    // execute or the pool is stopped 
-                    cv_.wait(lock, [this] { 
-                        return !tasks_.empty() || stop_; 
-                    }); 
-
-                    // exit the thread in case the pool 
-                    // is stopped and there are no tasks 
-                    if (stop_ && tasks_.empty()) { 
-                        return; 
-                    } 
-
-                    // Get the next task from the queue 
-                    task = std::move(tasks_.front()); 
-                    tasks_.pop(); 
-                } 
-
-                task();
-                active_tasks_--;
-            } 
-        }); 
-    } 
+ThreadPool::ThreadPool(int num_threads) : next_queue_(0), sleeping_threads_(0), queued_tasks_(0), stop_(false), active_tasks_(0) {
+    if (num_threads <= 0) {
+        num_threads = std::thread::hardware_concurrency();
+    }
+    num_threads = std::max(1, std::min(num_threads, MAX_THREADS));
+
+    for (int i = 0; i < num_threads; ++i) {
+        queues_.emplace_back(new WorkQueue());
+        queues_.back()->jobs.resize(INITIAL_QUEUE_CAPACITY);
+    }
+    // Creating worker threads, only after every deque exists
+    // because workers steal from all of them
+    for (int i = 0; i < num_threads; ++i) {
+        threads_.emplace_back([this, i] {
+            workerLoop(i);
+        });
+    }
 }
 
 // DESTRUCTOR
-// Destructor to stop the thread pool 
-ThreadPool::~ThreadPool() { 
-    { 
-        // Lock the queue to update the stop flag safely 
-        std::unique_lock<std::mutex> lock(queue_mutex_); 
-        stop_ = true; 
-    } 
-
-    // Notify all threads 
-    cv_.notify_all(); 
-
-    // Joining all worker threads to ensure they have 
-    // completed their tasks 
-    for (auto& thread : threads_) { 
-        thread.join(); 
-    } 
+// Destructor to stop the thread pool
+ThreadPool::~ThreadPool() {
+    {
+        // Lock so no worker misses the stop flag between
+        // checking it and going to sleep
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        stop_ = true;
+    }
+
+    // Notify all threads
+    cv_.notify_all();
+
+    // Joining all worker threads to ensure they have
+    // completed their tasks
+    for (auto& thread : threads_) {
+        thread.join();
+    }
 }
 
-// Enqueue task for execution by the thread pool 
-void ThreadPool::addTask(std::function<void()> task) { 
+// Enqueue task for execution by the thread pool
+void ThreadPool::push(Task&& task, TaskGroup* group) {
     active_tasks_++;
-    // std::cout << active_tasks_ << std::endl;
-    { 
-        std::unique_lock<std::mutex> lock(queue_mutex_); 
-        tasks_.emplace(std::move(task)); 
-    } 
-    cv_.notify_one(); 
-} 
+
+    // workers keep their own tasks, everyone else spreads them out
+    int index = current_pool == this ? worker_index : next_queue_++ % queues_.size();
+    WorkQueue& queue = *queues_[index];
+    bool full;
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        int capacity = queue.jobs.size();
+        if (queue.size == capacity && capacity < QUEUE_CAPACITY) {
+            // unwrap into a deque twice the size, the oldest job ends up first
+            std::vector<Job> grown(2 * capacity);
+            for (int i = 0; i < queue.size; i++) {
+                grown[i] = std::move(queue.jobs[(queue.head + i) % capacity]);
+            }
+            queue.jobs.swap(grown);
+            queue.head = 0;
+            capacity = queue.jobs.size();
+        }
+        full = queue.size == capacity;
+        if (!full) {
+            Job& job = queue.jobs[(queue.head + queue.size) % capacity];
+            job.task = std::move(task);
+            job.group = group;
+            queue.size++;
+            queued_tasks_++;
+        }
+    }
+    if (full) {
+        Job job;
+        job.task = std::move(task);
+        job.group = group;
+        run(job);
+        return;
+    }
+
+    // only touch the shared mutex when someone might be asleep
+    if (sleeping_threads_ > 0) {
+        { std::lock_guard<std::mutex> lock(sleep_mutex_); }
+        cv_.notify_one();
+    }
+}
+
+bool ThreadPool::popOwn(int index, Job& job) {
+    WorkQueue& queue = *queues_[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.size == 0) {
+        return false;
+    }
+    queue.size--;
+    job = std::move(queue.jobs[(queue.head + queue.size) % queue.jobs.size()]);
+    queued_tasks_--;
+    return true;
+}
+
+bool ThreadPool::steal(int index, Job& job) {
+    int numQueues = queues_.size();
+    for (int i = 1; i < numQueues; i++) {
+        WorkQueue& queue = *queues_[(index + i) % numQueues];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.size == 0) {
+            continue;
+        }
+        job = std::move(queue.jobs[queue.head]);
+        queue.head = (queue.head + 1) % queue.jobs.size();
+        queue.size--;
+        queued_tasks_--;
+        return true;
+    }
+    return false;
+}
+
+bool ThreadPool::popFromGroup(const TaskGroup* group, Job& job) {
+    // only the ends of each deque are checked, a waiting thread never picks up unrelated work
+    for (auto& queuePtr : queues_) {
+        WorkQueue& queue = *queuePtr;
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.size == 0) {
+            continue;
+        }
+        Job& back = queue.jobs[(queue.head + queue.size - 1) % queue.jobs.size()];
+        if (back.group == group) {
+            job = std::move(back);
+            queue.size--;
+            queued_tasks_--;
+            return true;
+        }
+        Job& front = queue.jobs[queue.head];
+        if (front.group == group) {
+            job = std::move(front);
+            queue.head = (queue.head + 1) % queue.jobs.size();
+            queue.size--;
+            queued_tasks_--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::run(Job& job) {
+    job.task();
+    job.task.reset();
+    active_tasks_--;
+    if (job.group != nullptr) {
+        job.group->finishTask();
+        job.group = nullptr;
+    }
+}
+
+void ThreadPool::workerLoop(int index) {
+    current_pool = this;
+    worker_index = index;
+    while (true) {
+        Job job;
+        if (popOwn(index, job) || steal(index, job)) {
+            run(job);
+            continue;
+        }
+
+        // Nothing to do anywhere, wait until there is a task
+        // to execute or the pool is stopped
+        sleeping_threads_++;
+        {
+            std::unique_lock<std::mutex> lock(sleep_mutex_);
+            cv_.wait(lock, [this] {
+                return queued_tasks_ > 0 || stop_;
+            });
+        }
+        sleeping_threads_--;
+
+        // exit the thread in case the pool
+        // is stopped and there are no tasks
+        if (stop_ && queued_tasks_ == 0) {
+            return;
+        }
+    }
+}
 
 int ThreadPool::getNumberOfActiveTasks() {
-    // std::cout << "Active tasks: " << active_tasks_.load(std::memory_order_seq_cst) << std::endl;
     return active_tasks_.load(std::memory_order_seq_cst);
-}
\ No newline at end of file
+}
+
+int ThreadPool::getNumberOfThreads() {
+    return threads_.size();
+}
+
+size_t ThreadPool::getMemoryUsage() {
+    size_t total = queues_.capacity() * sizeof(std::unique_ptr<WorkQueue>) + threads_.capacity() * sizeof(std::thread);
+    for (auto& queuePtr : queues_) {
+        std::lock_guard<std::mutex> lock(queuePtr->mutex);
+        total += sizeof(WorkQueue) + queuePtr->jobs.capacity() * sizeof(Job);
+    }
+    return total;
+}
+
+
+// TASK GROUP
+TaskGroup::TaskGroup(ThreadPool& pool) : pool_(pool), pending_(0) {}
+TaskGroup::TaskGroup() : TaskGroup(threadPool) {}
+TaskGroup::~TaskGroup() {
+    wait();
+}
+
+void TaskGroup::wait() {
+    while (pending_ > 0) {
+        ThreadPool::Job job;
+        if (pool_.popFromGroup(this, job)) {
+            pool_.run(job);
+            continue;
+        }
+        // everything left is running on workers. The timeout only matters when one of
+        // those tasks adds more tasks to this group, which can then be helped with again
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait_for(lock, std::chrono::milliseconds(1), [this] {
+            return pending_ == 0;
+        });
+    }
+    // the last task decrements under the lock, so once it is taken here that task is
+    // done with this group and it can safely be destroyed
+    std::lock_guard<std::mutex> lock(mutex_);
+}
+
+int TaskGroup::getNumberOfPendingTasks() {
+    return pending_.load();
+}
+
+void TaskGroup::finishTask() {
+    // every task but the last finishes without locking
+    int pending = pending_.load();
+    while (pending > 1) {
+        if (pending_.compare_exchange_weak(pending, pending - 1)) {
+            return;
+        }
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--pending_ == 0) {
+        cv_.notify_all();
+    }
+}
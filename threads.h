@@ -4,37 +4,195 @@
 #include <thread>
 #include <condition_variable>
 #include <mutex>
-#include <queue>
 #include <atomic>
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// number of worker threads in threads::threadPool, 0 follows std::thread::hardware_concurrency.
+// NOTE: the browser build can't start more threads than -sPTHREAD_POOL_SIZE
+#ifndef THREAD_POOL_SIZE
+#define THREAD_POOL_SIZE 0
+#endif
 
 namespace threads {
 
+    // Callable stored inline instead of on the heap like std::function, so submitting a task
+    // never allocates. Lambdas whose captures don't fit in CAPACITY bytes fail to compile
+    class Task {
+    public:
+        static const int CAPACITY = 48;
+
+        Task() : call_(nullptr), manage_(nullptr) {}
+        template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Task>::value>::type>
+        Task(F&& function) {
+            using Callable = typename std::decay<F>::type;
+            static_assert(sizeof(Callable) <= CAPACITY, "task captures too much, capture a pointer to the data instead");
+            static_assert(alignof(Callable) <= alignof(std::max_align_t), "task captures an over-aligned type");
+            new (storage_) Callable(std::forward<F>(function));
+            call_ = [](void* callable) {
+                (*static_cast<Callable*>(callable))();
+            };
+            // moves src into dst (when dst is given) and destroys src
+            manage_ = [](void* dst, void* src) {
+                if (dst != nullptr) {
+                    new (dst) Callable(std::move(*static_cast<Callable*>(src)));
+                }
+                static_cast<Callable*>(src)->~Callable();
+            };
+        }
+        Task(Task&& other) : call_(other.call_), manage_(other.manage_) {
+            if (manage_ != nullptr) {
+                manage_(storage_, other.storage_);
+                other.call_ = nullptr;
+                other.manage_ = nullptr;
+            }
+        }
+        Task& operator=(Task&& other) {
+            if (this != &other) {
+                reset();
+                call_ = other.call_;
+                manage_ = other.manage_;
+                if (manage_ != nullptr) {
+                    manage_(storage_, other.storage_);
+                    other.call_ = nullptr;
+                    other.manage_ = nullptr;
+                }
+            }
+            return *this;
+        }
+        Task(const Task&) = delete;
+        Task& operator=(const Task&) = delete;
+        ~Task() { reset(); }
+
+        void operator()() { call_(storage_); }
+        explicit operator bool() const { return call_ != nullptr; }
+        void reset() {
+            if (manage_ != nullptr) {
+                manage_(nullptr, storage_);
+            }
+            call_ = nullptr;
+            manage_ = nullptr;
+        }
+
+    private:
+        alignas(std::max_align_t) unsigned char storage_[CAPACITY];
+        void (*call_)(void*);
+        void (*manage_)(void*, void*);
+    };
+
+    class TaskGroup;
+
+    // Work stealing pool. Every worker owns a deque, it takes the newest task from
+    // its own deque and steals the oldest task from the others when it runs dry, so workers only
+    // contend when stealing. Tasks added from outside the pool are spread over the deques round robin
     class ThreadPool {
     public:
-        ThreadPool(int num_threads);
+        static const int INITIAL_QUEUE_CAPACITY = 64; // per worker, doubled whenever a deque is full
+        static const int QUEUE_CAPACITY = 4096; // per worker at most, tasks added to a full deque run on the caller
+
+        ThreadPool(int num_threads); // num_threads <= 0 uses one thread per hardware thread
         ~ThreadPool();
-        void addTask(std::function<void()> task);
+        template <typename F>
+        void addTask(F&& task) { push(Task(std::forward<F>(task)), nullptr); }
         int getNumberOfActiveTasks();
-    private: 
-        // Vector to store worker threads 
-        std::vector<std::thread> threads_; 
-    
-        // Queue of tasks 
-        std::queue<std::function<void()> > tasks_; 
-    
-        // Mutex to synchronize access to shared data 
-        std::mutex queue_mutex_; 
-    
-        // Condition variable to signal changes in the state of 
-        // the tasks queue 
-        std::condition_variable cv_; 
-    
-        // Flag to indicate whether the thread pool should stop 
-        // or not 
-        bool stop_ = false; 
+        int getNumberOfThreads();
+        size_t getMemoryUsage(); // bytes in the deques, they keep the size they grew to
+    private:
+        friend class TaskGroup;
+
+        // a task and the group waiting for it, if any
+        struct Job {
+            Task task;
+            TaskGroup* group = nullptr;
+        };
+
+        // ring buffer of jobs, the owner works on the back and thieves take from the front.
+        // jobs.size() is the capacity, it only grows
+        struct WorkQueue {
+            std::mutex mutex;
+            std::vector<Job> jobs;
+            int head = 0;
+            int size = 0;
+        };
+
+        void push(Task&& task, TaskGroup* group);
+        bool popOwn(int index, Job& job);
+        bool steal(int index, Job& job);
+        bool popFromGroup(const TaskGroup* group, Job& job);
+        void run(Job& job);
+        void workerLoop(int index);
+
+        // Vector to store worker threads
+        std::vector<std::thread> threads_;
+
+        // One deque per worker thread
+        std::vector<std::unique_ptr<WorkQueue> > queues_;
+
+        // Where the next task from outside the pool goes
+        std::atomic<unsigned int> next_queue_;
+
+        // Idle workers sleep on this until tasks are queued or
+        // the pool is stopped
+        std::mutex sleep_mutex_;
+        std::condition_variable cv_;
+        std::atomic<int> sleeping_threads_;
+        std::atomic<int> queued_tasks_;
+
+        // Flag to indicate whether the thread pool should stop
+        // or not
+        std::atomic<bool> stop_;
 
         // Atomic counter to keep track of number of active tasks
         std::atomic<int> active_tasks_;
     };
-    inline ThreadPool threadPool = ThreadPool(20);
-}
\ No newline at end of file
+
+    // Tasks that can be waited for as a unit, without waiting for everything else in the pool.
+    // wait() runs the group's own queued tasks on the calling thread instead of just sleeping,
+    // and returns as soon as the last of them has finished. A group can be reused after wait()
+    class TaskGroup {
+    public:
+        TaskGroup(ThreadPool& pool);
+        TaskGroup(); // uses threads::threadPool
+        ~TaskGroup(); // waits for the remaining tasks
+
+        template <typename F>
+        void addTask(F&& task) {
+            pending_++;
+            pool_.push(Task(std::forward<F>(task)), this);
+        }
+        void wait();
+        int getNumberOfPendingTasks();
+    private:
+        friend class ThreadPool;
+
+        void finishTask();
+
+        ThreadPool& pool_;
+        std::atomic<int> pending_;
+
+        // only used to sleep when every remaining task is already running on a worker
+        std::mutex mutex_;
+        std::condition_variable cv_;
+    };
+
+    inline ThreadPool threadPool = ThreadPool(THREAD_POOL_SIZE);
+
+    // Splits [begin, end) into chunks of grain indices (the last one may be smaller) and adds one
+    // task per chunk to tasks, each calling function(chunkBegin, chunkEnd). Every task holds its
+    // own copy of function, so it has to fit in a Task next to the two bounds
+    template <typename F>
+    void parallelFor(TaskGroup& tasks, int begin, int end, int grain, const F& function) {
+        grain = std::max(grain, 1);
+        for (int start = begin; start < end; start += grain) {
+            int stop = std::min(start + grain, end);
+            tasks.addTask([function, start, stop] {
+                function(start, stop);
+            });
+        }
+    }
+}